@@ -18,49 +18,67 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
 
 #include "fdmgr.h"
 #include "cvtFast.h"
 #include "cadef.h"
 #include "alarm.h"			/* alarm status, severity     */
 #include "alarmString.h"
+#include "epicsMutex.h"
 
 #include "camonitorVersion.h"
+#include "camonitor.h"
+#include "camonitorRecord.h"
+#include "camonitorSink.h"
+#include "camonitorStore.h"
+#include "camonitorFilter.h"
 
-#define FDMGR_SEC_TIMEOUT        10              /* seconds       */
+#define FDMGR_SEC_TIMEOUT        1               /* seconds       */
 #define FDMGR_USEC_TIMEOUT       0               /* micro-seconds */
 
 #define CA_PEND_EVENT_TIME	0.001
-#define CONNECTION_WAIT_SECONDS	3.0
+#define CONNECTION_WAIT_SECONDS	3.0     /* first connects are not reported */
+#define CONN_SUMMARY_SECONDS	60.0    /* between unconnected summaries */
+#define CONN_REPORT_MAX         20      /* transitions shown per summary */
+#define CONN_SUMMARY_NAMES      10      /* unconnected PVs named */
 
-#define CAM_ADD            1  
-#define CAM_REMOVE         2
-#define MAX_CHAN_MON     100
-#define MAX_CHAN_NAM_LEN 100
-
-#define TRUE            1
-#define FALSE           0
+#define LINE_CHUNK       256     /* longer than any single linePrintf */
+#define INPUT_LINE_LEN   512     /* PV name, command and filter */
 
 /* globals */
 int DEBUG;
+int RECORD;                   /* -record: write record file, and only the
+                               * outputs given with it */
+int SERVE;                    /* -serve: keep the latest values */
+static volatile sig_atomic_t stopRequested;  /* the signal received */
 
 struct chanDB_s {      /* global database of channels and associated names */
   chid chid;            /* these are the channels we currently have mon's on */
-  char chanNam[MAX_CHAN_MON];
-} DB_as[MAX_CHAN_NAM_LEN] = {{0}};    /* zero chid means slot not used */
+  struct monitor_s *pmon;
+  char chanNam[MAX_CHAN_NAM_LEN];
+} *DB_as;             /* connected or not, until STOP */
+int nDB_as;
+int capDB_as;
+epicsMutexId chanDBLock;      /* protects the database and the monitor_s
+                               * connection state, shared by the shards */
+int connReports;              /* transitions shown since the last summary */
+int connSuppressed;           /* and not shown */
+
+struct formatter_s mainFormatter;  /* used when not sharded */
 
 /* forward declarations */
 static void processAccessRightsEvent(struct access_rights_handler_args args);
 void processChangeConnectionEvent( struct connection_handler_args args);
-void processNewEvent( struct event_handler_args args);
-
 /*
  * Channel Database.   Called by addMonitor and remMonitor to add or remove
- * a channel to it's local database (table).  
- * func is either ADD or REMOVE
+ * a channel to it's local database (table), which grows as needed.
+ * Channels stay in it from START to STOP whether connected or not.
+ * func is either ADD or REMOVE, the caller holds chanDBLock.
  * Returns 0 for failure. 1 for success.
  */
 int chanDB (chid* chid, char* channelName, int func)
@@ -68,31 +86,34 @@ int chanDB (chid* chid, char* channelName, int func)
   int ii;   /* loop counter */
 
   if (func == CAM_ADD) {
-    for ( ii = 0; ii<MAX_CHAN_MON; ii++) {
-      if (DB_as[ii].chid == 0) {             /* slot is available */
-	DB_as[ii].chid = *chid;
-        strncpy (DB_as[ii].chanNam, channelName, MAX_CHAN_NAM_LEN);
-	break;
-      }
-      if (ii == MAX_CHAN_MON -1) {
-        printf("ERROR: Array overflow in chanDB\n");
+    if (nDB_as == capDB_as) {
+      int cap = capDB_as ? 2 * capDB_as : 128;
+      struct chanDB_s *p;
+
+      p = (struct chanDB_s *)realloc(DB_as, cap * sizeof(struct chanDB_s));
+      if (!p) {
+        fprintf(stderr, "ERROR: Array overflow in chanDB\n");
         return (0);
       }
+      DB_as = p;
+      capDB_as = cap;
     }
+    DB_as[nDB_as].chid = *chid;
+    DB_as[nDB_as].pmon = (struct monitor_s *)ca_puser(*chid);
+    strncpy (DB_as[nDB_as].chanNam, channelName, MAX_CHAN_NAM_LEN-1);
+    DB_as[nDB_as].chanNam[MAX_CHAN_NAM_LEN-1] = 0;
+    nDB_as++;
   }
   else if (func == CAM_REMOVE) {
-    for ( ii = 0; ii<MAX_CHAN_MON; ii++) {
+    for ( ii = 0; ii<nDB_as; ii++) {
       if (strcmp(channelName, DB_as[ii].chanNam) == 0) { /* found chanName*/
         *chid = DB_as[ii].chid;                      /* return chid to caller*/ 
-        strcpy(DB_as[ii].chanNam,"     ");           /* free up slot */
-	DB_as[ii].chid = 0;                             
-        break;
-      }
-      if (ii == MAX_CHAN_MON -1) {
-        printf("ERROR: Channel not found in chanDB Database\n");
-        return (0);
+        DB_as[ii] = DB_as[--nDB_as];                 /* free up slot */
+        return (1);
       }
     }
+    fprintf(stderr, "ERROR: Channel not found in chanDB Database\n");
+    return (0);
   }
   else {                                            /* else bad func code */
     return(0);
@@ -101,32 +122,171 @@ int chanDB (chid* chid, char* channelName, int func)
   return(1);
 }
 
-void addMonitor(char *channelName)
+/*
+ * Report a connection change of pmon, at most CONN_REPORT_MAX of them
+ * between summaries so that an IOC with thousands of PVs rebooting does
+ * not flood the output.  The caller holds chanDBLock.
+ */
+static void connectionReport(struct monitor_s *pmon, const char *what)
+{
+  char timeText[28];
+
+  if (connReports >= CONN_REPORT_MAX) {
+    connSuppressed++;
+    return;
+  }
+  connReports++;
+  epicsTimeToStrftime(timeText, 28, "%m/%d/%y %H:%M:%S.%03f", &pmon->since);
+  fprintf(stderr, "[%s] %s %s\n", pmon->name, what, timeText);
+}
+
+/*
+ * Called from the main loop.  Shortly after startup and then every
+ * CONN_SUMMARY_SECONDS, list the channels that are not connected and
+ * count the transitions connectionReport left out.  CA keeps searching
+ * for unconnected channels with its own backoff, and searches again at
+ * once when it sees a new IOC's beacons, so nothing is retried here.
+ */
+static void connectionPoll(void)
+{
+  static epicsTimeStamp next;
+  epicsTimeStamp now;
+  char names[CONN_SUMMARY_NAMES * (MAX_CHAN_NAM_LEN + 1) + 8];
+  size_t len = 0;
+  int total, unconnected = 0, suppressed;
+  int ii;
+
+  epicsTimeGetCurrent(&now);
+  if (!next.secPastEpoch) {
+    next = now;
+    epicsTimeAddSeconds(&next, CONNECTION_WAIT_SECONDS);
+    return;
+  }
+  if (epicsTimeLessThan(&now, &next)) return;
+  next = now;
+  epicsTimeAddSeconds(&next, CONN_SUMMARY_SECONDS);
+
+  names[0] = 0;
+  epicsMutexMustLock(chanDBLock);
+  total = nDB_as;
+  for (ii = 0; ii < nDB_as; ii++) {
+    if (DB_as[ii].pmon->connected) continue;
+    if (unconnected++ < CONN_SUMMARY_NAMES)
+      len += sprintf(names + len, " %s", DB_as[ii].chanNam);
+  }
+  suppressed = connSuppressed;
+  connSuppressed = 0;
+  connReports = 0;
+  epicsMutexUnlock(chanDBLock);
+
+  if (suppressed)
+    fprintf(stderr, "%d more connection changes not shown\n", suppressed);
+  if (unconnected)
+    fprintf(stderr, "%d of %d channels not connected:%s%s\n", unconnected,
+      total, names, unconnected > CONN_SUMMARY_NAMES ? " ..." : "");
+}
+
+/*
+ * Start or stop monitoring channelName, or change its filter, in the
+ * owning shard's thread with -threads.  The filter is compiled here so
+ * that mistakes are reported at once; filterText may be NULL.
+ */
+static void requestMonitor(char *channelName, int func,
+  const char *filterText)
+{
+  struct filter_s *filter = NULL;
+
+  if (filterText && *filterText) {
+    filter = filterCompile(filterText);
+    if (!filter) {
+      fprintf(stderr, "[%s] %s\n", channelName, func == CAM_ADD ?
+        "not monitored" : "filter not changed");
+      return;
+    }
+  }
+  if (nShards) shardCommand(channelName, func, filter);
+  else if (func == CAM_ADD) addMonitor(channelName, NULL, filter);
+  else if (func == CAM_FILTER) filterMonitor(channelName, filter);
+  else remMonitor(channelName);
+}
+
+/*
+ * Add a monitor on input channelName in the current CA context,
+ * shard is the shard owning that context or NULL, filter is
+ * owned by the monitor from now on
+ */
+void addMonitor(char *channelName, struct shard_s *shard,
+  struct filter_s *filter)
 {
   int status;
   chid chid;
-  time_t startTime, currentTime;
+  struct monitor_s *pmon;
 
 
-  if (DEBUG) printf("addMonitor for [%s]\n",channelName);
+  if (DEBUG) fprintf(stderr, "addMonitor for [%s]\n",channelName);
 
-  status = ca_search_and_connect(channelName,&chid,processChangeConnectionEvent,NULL);
+  pmon = (struct monitor_s *)calloc(1,sizeof(struct monitor_s));
+  if (!pmon) {
+    fprintf (stderr, "memory allocation failed\n");
+    fprintf (stderr, "Unable to monitor PV\n");
+    filterFree(filter);
+    return;
+  }
+  strncpy(pmon->name, channelName, MAX_CHAN_NAM_LEN-1);
+  pmon->filter = filter;
+  pmon->recordId = -1;
+  pmon->storeId = -1;
+  pmon->shard = shard;
+  epicsTimeGetCurrent(&pmon->since);
+
+  status = ca_search_and_connect(channelName,&chid,processChangeConnectionEvent,pmon);
   SEVCHK(status,"ca_search_and_connect failed\n");
-  if (status != ECA_NORMAL) return;
-  ca_set_puser(chid,FALSE);
+  if (status != ECA_NORMAL) {
+    filterFree(filter);
+    free(pmon);
+    return;
+  }
 
-  currentTime = time(&startTime);
-  while ((ca_field_type(chid) == TYPENOTCONN) &&
-    (difftime(currentTime, startTime)<CONNECTION_WAIT_SECONDS) ){
-    ca_pend_event(.1);
-    time(&currentTime);
+  /*
+   * Not waiting for the connection, processChangeConnectionEvent starts
+   * the monitor whenever it comes and connectionPoll reports it missing.
+   */
+  epicsMutexMustLock(chanDBLock);
+  status = chanDB(&chid, channelName, CAM_ADD);  /* save chid so we can remove */
+  epicsMutexUnlock(chanDBLock);
+  if (!status) {
+    ca_clear_channel(chid);
+    filterFree(filter);
+    free(pmon);
   }
-  if (ca_field_type(chid) == TYPENOTCONN){
-    printf("[%s] not connected\n",channelName);
+}
+
+/*
+ * Replace the filter of channelName, NULL to output every update.
+ * Called in the thread owning the channel, like remMonitor.
+ */
+void filterMonitor(char *channelName, struct filter_s *filter)
+{
+  struct monitor_s *pmon = NULL;
+  struct filter_s *old;
+  int ii;
+
+  epicsMutexMustLock(chanDBLock);
+  for (ii = 0; ii < nDB_as; ii++) {
+    if (strcmp(channelName, DB_as[ii].chanNam) == 0) {
+      pmon = DB_as[ii].pmon;
+      break;
+    }
   }
-  else {
-    chanDB(&chid, channelName, CAM_ADD);  /* save chid so we can remove */
+  epicsMutexUnlock(chanDBLock);
+  if (!pmon) {
+    fprintf(stderr, "[%s] not monitored, filter not changed\n", channelName);
+    filterFree(filter);
+    return;
   }
+  old = pmon->filter;
+  pmon->filter = filter;
+  filterFree(old);
 }
 
 /*
@@ -135,36 +295,46 @@ void addMonitor(char *channelName)
 void remMonitor(char *channelName)
 {
   int status;
+  int found;
   chid chid;
+  struct monitor_s *pmon;
 
-  if (DEBUG) printf("remMonitor for [%s]\n",channelName);
+  if (DEBUG) fprintf(stderr, "remMonitor for [%s]\n",channelName);
 
   /* Find the chid associated with the channelName */
-  if (!chanDB(&chid, channelName, CAM_REMOVE)) {
-    if (DEBUG) printf ("ERROR: Channel not found in database \n");
+  epicsMutexMustLock(chanDBLock);
+  found = chanDB(&chid, channelName, CAM_REMOVE);
+  epicsMutexUnlock(chanDBLock);
+  if (!found) {
+    if (DEBUG) fprintf (stderr, "ERROR: Channel not found in database \n");
     return;
   }
 
+  pmon = (struct monitor_s *)ca_puser(chid);
   status = ca_clear_channel(chid);
   SEVCHK(status,"ca_clear_channel failed\n");
   if (status != ECA_NORMAL) return;
+  if (SERVE) storeStale(pmon, STORE_STOPPED);
+  filterFree(pmon->filter);
+  free(pmon->states);
+  free(pmon);
   ca_pend_event(.1);
 }
 
 static void processAccessRightsEvent(struct access_rights_handler_args args)
 {
-  if (DEBUG) printf("processAccessRightsEvent for [%s]\n",ca_name(args.chid));
+  if (DEBUG) fprintf(stderr, "processAccessRightsEvent for [%s]\n",ca_name(args.chid));
 
   if (ca_field_type(args.chid) == TYPENOTCONN) return;
   if (!ca_read_access(args.chid)) {
-     printf (" %s  no read access\n",ca_name(args.chid));
+     fprintf (stderr, " %s  no read access\n",ca_name(args.chid));
   }
   if (!ca_write_access(args.chid)) {
-     printf (" %s  no write access\n",ca_name(args.chid));
+     fprintf (stderr, " %s  no write access\n",ca_name(args.chid));
   }
 }
 
-void startMonitor (chid chan, dbr_short_t *pprecision)
+void startMonitor (chid chan, struct monitor_s *pmon)
 {
     int request_type;
     int status;
@@ -179,14 +349,14 @@ void startMonitor (chid chan, dbr_short_t *pprecision)
 
     status = ca_add_masked_array_event (request_type, 
         ca_element_count(chan), chan, processNewEvent,
-       pprecision, 0.0f, 0.0f, 0.0f, &evid, DBE_VALUE|DBE_ALARM);
+       pmon, 0.0f, 0.0f, 0.0f, &evid, DBE_VALUE|DBE_ALARM);
     SEVCHK(status,"ca_add_masked_array_event failed\n");
 }
 
 void getPrecisionCallBack (struct event_handler_args args)
 {
     const struct dbr_gr_float *pvalue = (const struct dbr_gr_float *)args.dbr;
-    dbr_short_t *pprecision;
+    struct monitor_s *pmon = (struct monitor_s *)args.usr;
 
     if (args.status!=ECA_NORMAL) {
         fprintf (stderr, "dbr_gr_float get call back failed on analog channel \"%s\" because \"%s\"\n",
@@ -194,39 +364,75 @@ void getPrecisionCallBack (struct event_handler_args args)
         fprintf (stderr, "Unable to monitor PV\n");
         return;
     }
-    pprecision = (dbr_short_t *)calloc(1,sizeof(dbr_short_t));
-    if (!pprecision) {
-        fprintf (stderr, "memory allocation failed\n");
-        fprintf (stderr, "Unable to monitor PV\n");
+    pmon->precision = pvalue->precision;
+    startMonitor (args.chid, pmon);
+}
+
+/*
+ * Enums are monitored as strings, the state strings let filters use the
+ * state index as the value.  Without them filters see the string.
+ */
+void getStatesCallBack (struct event_handler_args args)
+{
+    struct monitor_s *pmon = (struct monitor_s *)args.usr;
+
+    if (args.status!=ECA_NORMAL) {
+        fprintf (stderr, "dbr_gr_enum get call back failed on enum channel \"%s\" because \"%s\"\n",
+                ca_name(args.chid), ca_message(args.status));
+    }
+    else if (!pmon->states) {
+        pmon->states = (struct dbr_gr_enum *)malloc(sizeof(struct dbr_gr_enum));
+        if (pmon->states) memcpy(pmon->states, args.dbr, sizeof(struct dbr_gr_enum));
     }
-    *pprecision = pvalue->precision;
-    startMonitor (args.chid, pprecision);
+    startMonitor (args.chid, pmon);
 }
 
 void processChangeConnectionEvent(struct connection_handler_args args)
 {
   int status;
+  struct monitor_s *pmon = (struct monitor_s *)ca_puser(args.chid);
+  epicsTimeStamp now;
 
-  if (DEBUG) printf("processChangeConnectionEvent for [%s]\n",ca_name(args.chid));
+  if (DEBUG) fprintf(stderr, "processChangeConnectionEvent for [%s]\n",ca_name(args.chid));
 
+  epicsTimeGetCurrent(&now);
+  epicsMutexMustLock(chanDBLock);
   if (args.op == CA_OP_CONN_DOWN) {
-     printf ("[%s] not connected\n",ca_name(args.chid));
-  } 
+    pmon->connected = FALSE;
+    pmon->since = now;
+    connectionReport(pmon, "disconnected");
+  }
   else {
-    if (ca_puser(args.chid) == (void *)TRUE) return;
-    ca_set_puser(args.chid,(void *)TRUE);
+    /* first connects are only news once the channel was missed */
+    int late = pmon->started ||
+      epicsTimeDiffInSeconds(&now, &pmon->since) >= CONNECTION_WAIT_SECONDS;
+
+    pmon->connected = TRUE;
+    pmon->since = now;
+    if (late) connectionReport(pmon, "connected");
+  }
+  epicsMutexUnlock(chanDBLock);
+
+  if (args.op == CA_OP_CONN_DOWN && SERVE) storeStale(pmon, STORE_DISCONNECTED);
+  if (args.op != CA_OP_CONN_DOWN) {
+    if (pmon->started) return;
+    pmon->started = TRUE;
     if (DEBUG) {
-        printf ("Number of elements  for [%s] is %ld\n",
+        fprintf (stderr, "Number of elements  for [%s] is %ld\n",
             ca_name(args.chid), ca_element_count(args.chid));
     }
 
     if (ca_field_type(args.chid) == DBF_DOUBLE ||
         ca_field_type(args.chid) == DBF_FLOAT ) {
-        status = ca_get_callback (DBR_GR_FLOAT, args.chid, getPrecisionCallBack, NULL);
+        status = ca_get_callback (DBR_GR_FLOAT, args.chid, getPrecisionCallBack, pmon);
         SEVCHK(status,"ca_get_callback() for precision failed\n");
     }
+    else if (ca_field_type(args.chid) == DBF_ENUM) {
+        status = ca_get_callback (DBR_GR_ENUM, args.chid, getStatesCallBack, pmon);
+        SEVCHK(status,"ca_get_callback() for enum states failed\n");
+    }
     else {
-        startMonitor (args.chid, NULL);
+        startMonitor (args.chid, pmon);
     }
 
     status = ca_replace_access_rights_event(args.chid, processAccessRightsEvent);
@@ -234,26 +440,104 @@ void processChangeConnectionEvent(struct connection_handler_args args)
   }
 }
 
+/*
+ * Make room for n more bytes in a formatter's buffer.  The buffer only
+ * grows when an update is longer than any before it.
+ * Returns 0, or -1 if memory ran out.
+ */
+int lineReserve(struct line_s *pline, size_t n)
+{
+  size_t size;
+  char *text;
+
+  if (pline->size - pline->len >= n) return 0;
+  size = pline->size ? 2 * pline->size : 4 * LINE_CHUNK;
+  while (size - pline->len < n) size *= 2;
+  text = (char *)realloc(pline->text, size);
+  if (!text) return -1;
+  pline->text = text;
+  pline->size = size;
+  return 0;
+}
+
+/* Append to the text line being formatted */
+static void linePrintf(struct line_s *pline, const char *format, ...)
+{
+  va_list args;
+  int n;
+
+  if (lineReserve(pline, LINE_CHUNK)) return;
+  va_start(args, format);
+  n = vsprintf(pline->text + pline->len, format, args);
+  va_end(args);
+  if (n > 0) pline->len += n;
+}
+
+/* To the sinks, through the shard's batches when sharded */
+static void output(struct monitor_s *pmon, int format,
+  const struct line_s *pline, const epicsTimeStamp *pstamp)
+{
+  if (pmon->shard) shardOutput(pmon->shard, format, pline->text, pline->len,
+    pstamp);
+  else sinkOutput(format, pline->text, pline->len, pstamp);
+}
+
 void processNewEvent(struct event_handler_args args)
 {
-  struct dbr_time_string *cdData;
-  char    timeText[28];
-  int i;
-  int count;
-  int type;
-  void *pbuffer;
+  struct monitor_s *pmon = (struct monitor_s *)args.usr;
+  struct formatter_s *pfmt;
+  const struct dbr_time_string *cdData;
 
-  if (DEBUG) printf("processNewEvent for [%s]\n",ca_name(args.chid));
+  if (DEBUG) fprintf(stderr, "processNewEvent for [%s]\n",pmon->name);
 
   if ( args.status != ECA_NORMAL ) {
-    printf ( "camonitor: update failed because \"%s\"\n",
+    fprintf (stderr, "camonitor: update failed because \"%s\"\n",
         ca_message ( args.status ) );
     return;
   }
 
+  if (SERVE) storeUpdate(pmon, &args);
+  if (pmon->filter && !filterMatch(pmon->filter, &args)) return;
+
+  if (RECORD) {
+    if (pmon->recordId < 0)
+      pmon->recordId = recordStream(pmon->name, pmon->precision);
+    recordEvent(pmon->recordId, args.type, args.count, args.dbr);
+  }
+
+  /* format once for every format in use, then hand to the sinks */
+  pfmt = pmon->shard ? shardFormatter(pmon->shard) : &mainFormatter;
+  cdData = (const struct dbr_time_string *) args.dbr;
+  if (sinkFormats & SINK_TEXT) {
+    formatText(&pfmt->text, pmon, &args);
+    output(pmon, SINK_TEXT, &pfmt->text, &cdData->stamp);
+  }
+  if (sinkFormats & SINK_BINARY) {
+    sinkFormatBinary(&pfmt->binary, pmon, &args);
+    output(pmon, SINK_BINARY, &pfmt->binary, &cdData->stamp);
+  }
+  if (sinkFormats & SINK_JSON) {
+    sinkFormatJson(&pfmt->json, pmon, &args);
+    output(pmon, SINK_JSON, &pfmt->json, &cdData->stamp);
+  }
+}
+
+/* camonitor's traditional text line */
+void formatText(struct line_s *pline, struct monitor_s *pmon,
+  struct event_handler_args *pargs)
+{
+  struct event_handler_args args = *pargs;
+  struct dbr_time_string *cdData;
+  char    timeText[28];
+  int i;
+  int count;
+  int type;
+  void *pbuffer;
+
+  pline->len = 0;
   cdData = (struct dbr_time_string *) args.dbr;
   epicsTimeToStrftime(timeText,28,"%m/%d/%y %H:%M:%S.%09f",&cdData->stamp);
-  printf(" %-30s %s ", ca_name(args.chid), timeText);
+  linePrintf(pline, " %-30s %s ", pmon->name, timeText);
 
   count = args.count;
   pbuffer = (void *)args.dbr;
@@ -265,7 +549,7 @@ void processNewEvent(struct event_handler_args args)
     struct dbr_time_string *pvalue 
       = (struct dbr_time_string *) pbuffer;
 
-    printf("%s ",pvalue->value);
+    linePrintf(pline, "%s ",pvalue->value);
     break;
   }
   case (DBR_TIME_ENUM):
@@ -275,8 +559,8 @@ void processNewEvent(struct event_handler_args args)
     dbr_enum_t *pshort = &pvalue->value;
 
     for (i = 0; i < count; i++,pshort++){
-      if(count!=1 && (i%10 == 0)) printf("\n");
-      printf("%d ",*pshort);
+      if(count!=1 && (i%10 == 0)) linePrintf(pline, "\n");
+      linePrintf(pline, "%d ",*pshort);
     }
     break;
   }
@@ -287,8 +571,8 @@ void processNewEvent(struct event_handler_args args)
     dbr_short_t *pshort = &pvalue->value;
 
     for (i = 0; i < count; i++,pshort++){
-      if(count!=1 && (i%10 == 0)) printf("\n");
-      printf("%d ",*pshort);
+      if(count!=1 && (i%10 == 0)) linePrintf(pline, "\n");
+      linePrintf(pline, "%d ",*pshort);
     }
     break;
   }
@@ -298,12 +582,11 @@ void processNewEvent(struct event_handler_args args)
       = (struct dbr_time_float *)pbuffer;
     dbr_float_t *pfloat = &pvalue->value;
     char string[MAX_STRING_SIZE];
-    dbr_short_t *pprecision =(short*)args.usr;
 
     for (i = 0; i < count; i++,pfloat++){
-      if(count!=1 && (i%10 == 0)) printf("\n");
-      cvtFloatToString(*pfloat,string,*pprecision);
-      printf("%s ",string);
+      if(count!=1 && (i%10 == 0)) linePrintf(pline, "\n");
+      cvtFloatToString(*pfloat,string,pmon->precision);
+      linePrintf(pline, "%s ",string);
     }
     break;
   }
@@ -314,8 +597,8 @@ void processNewEvent(struct event_handler_args args)
     dbr_char_t *pchar = &pvalue->value;
 
     for (i = 0; i < count; i++,pchar++){
-      if(count!=1 && (i%10 == 0)) printf("\n");
-      printf("%d ",(short)(*pchar));
+      if(count!=1 && (i%10 == 0)) linePrintf(pline, "\n");
+      linePrintf(pline, "%d ",(short)(*pchar));
     }
     break;
   }
@@ -326,8 +609,8 @@ void processNewEvent(struct event_handler_args args)
     dbr_long_t *plong = &pvalue->value;
 
     for (i = 0; i < count; i++,plong++){
-      if(count!=1 && (i%10 == 0)) printf("\n");
-      printf("%d ",*plong);
+      if(count!=1 && (i%10 == 0)) linePrintf(pline, "\n");
+      linePrintf(pline, "%d ",*plong);
     }
     break;
   }
@@ -337,24 +620,33 @@ void processNewEvent(struct event_handler_args args)
       = (struct dbr_time_double *)pbuffer;
     dbr_double_t *pdouble = &pvalue->value;
     char string[MAX_STRING_SIZE];
-    dbr_short_t *pprecision =(short*)args.usr;
 
     for (i = 0; i < count; i++,pdouble++){
-      if(count!=1 && (i%10 == 0)) printf("\n");
-      cvtDoubleToString(*pdouble,string,*pprecision);
-      printf("%s ",string);
+      if(count!=1 && (i%10 == 0)) linePrintf(pline, "\n");
+      cvtDoubleToString(*pdouble,string,pmon->precision);
+      linePrintf(pline, "%s ",string);
     }
     break;
   }
   }
 
   if (cdData->severity)
-    printf(" %s %s",
+    linePrintf(pline, " %s %s",
       alarmStatusString[cdData->status],
       alarmSeverityString[cdData->severity]); 
 
-  printf("\n");
-  fflush(0);
+  linePrintf(pline, "\n");
+}
+
+/*
+ * Ask the main loop to stop and close the outputs.  A second signal, or
+ * outputs that cannot be drained, end camonitor as the signal would.
+ */
+static void stopHandler(int sig)
+{
+  signal(sig, SIG_DFL);
+  sinkStopping = TRUE;
+  stopRequested = sig;
 }
 
 void processCA(void *notused)
@@ -365,7 +657,7 @@ void processCA(void *notused)
 
 void registerCA(void *pfdctx,int fd,int condition)
 {
-  if (DEBUG)  printf("registerCA with condition: %d\n",condition);
+  if (DEBUG)  fprintf(stderr, "registerCA with condition: %d\n",condition);
 
   if (condition){
     fdmgr_add_fd(pfdctx, fd, processCA, NULL);
@@ -377,34 +669,40 @@ void registerCA(void *pfdctx,int fd,int condition)
 /* This is called when the stdin file descr has input ready 
  * Input from the user looks like this for example:
  *  LI31:XCOR:41:BDES START
+ *  LI31:XCOR:41:BDES START abs(delta) > 0.5
+ *  LI31:XCOR:41:BDES FILTER changed(severity)
  *  LI31:QUAD:21:BDES STOP
+ * FILTER without an expression outputs every update again.
  */
 
 void processSTDIN(void *notused)
 {
- char input_line[80];
-
- if (fgets(input_line,80-1,stdin)==NULL) return;
- if (strstr(input_line,"START") != NULL) {  /* if contains start cmd */
-   if (DEBUG) printf("recvd START cmd\n");
-   if (strchr(input_line, ' ') !=NULL) {    /* if space found */
-     memset (strchr(input_line, ' '), 0, 1);  /* null terminate after PV */
-     if (strlen(input_line)) addMonitor(input_line);
-   }
-   else          /* else, command didn't parse, blank not found */
-     return;
+ char input_line[INPUT_LINE_LEN];
+ char *command;
+ char *filterText;
+
+ if (fgets(input_line,INPUT_LINE_LEN-1,stdin)==NULL) return;
+ input_line[strcspn(input_line, "\r\n")] = 0;
+ command = strchr(input_line, ' ');
+ if (command == NULL) return;   /* command didn't parse, blank not found */
+ *command++ = 0;                /* null terminate after PV */
+ if (!strlen(input_line)) return;
+ command += strspn(command, " ");
+ filterText = strchr(command, ' ');   /* the rest of the line */
+ if (filterText) *filterText++ = 0;
+
+ if (strcmp(command,"START") == 0) {
+   if (DEBUG) fprintf(stderr, "recvd START cmd\n");
+   requestMonitor(input_line, CAM_ADD, filterText);
+ }
+ else if (strcmp(command,"FILTER") == 0) {
+   if (DEBUG) fprintf(stderr, "recvd FILTER cmd\n");
+   requestMonitor(input_line, CAM_FILTER, filterText);
  }
  else {          /* else, stop command */
-   if (DEBUG) printf("recvd STOP cmd\n");
-   if (strchr(input_line, ' ') !=NULL) {    /* if space found */ 
-     memset (strchr(input_line, ' '), 0, 1);  /* null terminate after PV */
-     if (strlen(input_line)) {
-       if (DEBUG) printf("calling remMonitor for %s \n",input_line);  
-       remMonitor(input_line); 
-     }
-   }
-   else          /* else, command didn't parse, blank not found */
-     return;
+   if (DEBUG) fprintf(stderr, "recvd STOP cmd\n");
+   if (DEBUG) fprintf(stderr, "calling remMonitor for %s \n",input_line);  
+   requestMonitor(input_line, CAM_REMOVE, NULL);
  }
 }
 
@@ -413,10 +711,24 @@ int main(int argc,char *argv[])
    void *pfdctx;			/* fdmgr context */
    int printHelp=FALSE;
    int printVersion=FALSE;
+   char **pvNames;
+   char **pvFilters;
+   char *filterText=NULL;
+   char *recordDir=NULL;
+   char *replayName=NULL;
+   double replaySpeed=1.0;
+   char *logName=NULL;
+   double rotateMB=0.0;
+   double rotateSeconds=0.0;
+   int threads=0;
+   char *serveName=NULL;
+   int sinkGiven=FALSE;
    int i=1;
    int pvcount=0;
    static struct timeval timeout = {FDMGR_SEC_TIMEOUT, FDMGR_USEC_TIMEOUT};
 
+   chanDBLock = epicsMutexMustCreate();
+
    /*  initialize channel access */
    SEVCHK(ca_task_initialize(),
      "initializeCA: error in ca_task_initialize");
@@ -431,6 +743,13 @@ int main(int argc,char *argv[])
    SEVCHK(ca_add_fd_registration(registerCA,pfdctx),
      "initializeCA: error adding CA's fd to X");
 
+   pvNames = (char **)calloc(argc, sizeof(char *));
+   pvFilters = (char **)calloc(argc, sizeof(char *));
+   if (!pvNames || !pvFilters) {
+      fprintf (stderr, "memory allocation failed\n");
+      exit(1);
+   }
+
    /* get command line options if any  */
    DEBUG = FALSE;
    while (i < argc)
@@ -441,14 +760,55 @@ int main(int argc,char *argv[])
       else if (strcmp(argv[i],"\\v")      ==0 ) {printVersion=TRUE; break; }
       else if (strcmp(argv[i],"-version") ==0 ) {printVersion=TRUE; break; }
       else if (strcmp(argv[i],"\\version")==0 ) {printVersion=TRUE; break; }
+      else if (strcmp(argv[i],"-record")  ==0 && i+1 < argc) {
+        recordDir = argv[++i];
+      }
+      else if (strcmp(argv[i],"-replay")  ==0 && i+1 < argc) {
+        replayName = argv[++i];
+      }
+      else if (strcmp(argv[i],"-speed")   ==0 && i+1 < argc) {
+        replaySpeed = atof(argv[++i]);
+      }
+      else if (strcmp(argv[i],"-log")     ==0 && i+1 < argc) {
+        logName = argv[++i];
+      }
+      else if (strcmp(argv[i],"-json")    ==0 ) {
+        if (sinkAdd("stdout,block,format=json")) exit(1);
+        sinkGiven = TRUE;
+      }
+      else if (strcmp(argv[i],"-sink")    ==0 && i+1 < argc) {
+        if (sinkAdd(argv[++i])) exit(1);
+        sinkGiven = TRUE;
+      }
+      else if (strcmp(argv[i],"-rotate-size")==0 && i+1 < argc) {
+        rotateMB = atof(argv[++i]);
+      }
+      else if (strcmp(argv[i],"-rotate-time")==0 && i+1 < argc) {
+        rotateSeconds = atof(argv[++i]);
+      }
+      else if (strcmp(argv[i],"-filter")  ==0 && i+1 < argc) {
+        struct filter_s *filter;
+
+        filterText = argv[++i];
+        if (*filterText) {              /* "" for no filter */
+          if (!(filter = filterCompile(filterText))) exit(1);
+          filterFree(filter);
+        }
+      }
+      else if (strcmp(argv[i],"-serve")   ==0 && i+1 < argc) {
+        serveName = argv[++i];
+      }
+      else if (strcmp(argv[i],"-threads") ==0 && i+1 < argc) {
+        threads = atoi(argv[++i]);
+      }
       else if (strcmp(argv[i],"?")        ==0 ) {printHelp=TRUE; break; }
       else if (strncmp(argv[i],"-",1)     ==0 ) {printHelp=TRUE; break; }
       else if (strncmp(argv[i],"\\",1)    ==0 ) {printHelp=TRUE; break; }
       else  {
-        /* add ca monitor for each  PVname on the command line */
-        if (DEBUG) printf("PVname%d: %s\n",i,argv[i]);
-        addMonitor(argv[i]);
-        pvcount++;
+        /* ca monitors are added once the output is set up */
+        if (DEBUG) fprintf(stderr, "PVname%d: %s\n",i,argv[i]);
+        pvFilters[pvcount] = filterText;
+        pvNames[pvcount++] = argv[i];
       }
      i++;
    }
@@ -461,7 +821,8 @@ int main(int argc,char *argv[])
    if (printHelp) {
       fprintf(stderr, "\n \tusage: %s \n",argv[0]);
       fprintf(stderr, "\tPV1 START\n");
-      fprintf(stderr, "\tPV2 START\n");
+      fprintf(stderr, "\tPV2 START [filter]\n");
+      fprintf(stderr, "\tPV2 FILTER [filter]\n");
       fprintf(stderr, "\tPV1 STOP\n");
       fprintf(stderr, "\tPV2 STOP\n\n");
    
@@ -469,10 +830,71 @@ int main(int argc,char *argv[])
 
       fprintf(stderr, "\tOr, you can mix and match those two usages \n\n");
 
+      fprintf(stderr, "\t-record dir  write updates to a record file in dir\n");
+      fprintf(stderr, "\t             instead of stdout, or as well as the\n");
+      fprintf(stderr, "\t             -sink -json and -log outputs, see\n");
+      fprintf(stderr, "\t             camonitorread\n");
+      fprintf(stderr, "\t-replay file replay a record file instead of\n");
+      fprintf(stderr, "\t             connecting to PVs\n");
+      fprintf(stderr, "\t-speed N     replay at N times the recorded rate,\n");
+      fprintf(stderr, "\t             0 for as fast as possible (default 1)\n");
+      fprintf(stderr, "\t-log base    write text output to LZ4 compressed\n");
+      fprintf(stderr, "\t             files base-YYYYMMDD-HHMMSS.lz4\n");
+      fprintf(stderr, "\t-rotate-size MB  start a new log file after MB\n");
+      fprintf(stderr, "\t-rotate-time s   start a new log file after s seconds\n");
+      fprintf(stderr, "\t-json        write one JSON object per update to stdout\n");
+      fprintf(stderr, "\t-sink kind[:target][,option...]  add an output, may\n");
+      fprintf(stderr, "\t             be repeated, kinds stdout file unix lz4,\n");
+      fprintf(stderr, "\t             options format=text|binary|json buffer=KB\n");
+      fprintf(stderr, "\t             drop block rotate-size=MB rotate-time=s\n");
+      fprintf(stderr, "\t-threads N   monitor the PVs from N threads, each\n");
+      fprintf(stderr, "\t             with its own CA context\n");
+      fprintf(stderr, "\t-filter expr output only the updates for which expr is\n");
+      fprintf(stderr, "\t             true, for the PVs after it on the command\n");
+      fprintf(stderr, "\t             line, e.g. \"value > 3.2 && severity >= MINOR\"\n");
+      fprintf(stderr, "\t             \"abs(delta) > 0.5\" \"changed(severity)\"\n");
+      fprintf(stderr, "\t-serve path  answer GET and SUBSCRIBE for the latest\n");
+      fprintf(stderr, "\t             values on a Unix socket, nothing goes\n");
+      fprintf(stderr, "\t             to stdout unless -sink or -json is given\n\n");
+
       exit(1);
    }
  
-   if(DEBUG) printf("pvcount=%d\n",pvcount);
+   if(DEBUG) fprintf(stderr, "pvcount=%d\n",pvcount);
+
+   if (recordDir) {
+      if (recordOpen(recordDir)) exit(1);
+      RECORD = TRUE;
+   }
+   if (logName) {
+      char spec[1024];
+
+      sprintf(spec, "lz4:%.900s,rotate-size=%g,rotate-time=%g",
+        logName, rotateMB, rotateSeconds);
+      if (sinkAdd(spec)) exit(1);
+      sinkGiven = TRUE;
+   }
+   if (serveName) {
+      if (storeOpen(serveName)) exit(1);
+      SERVE = TRUE;
+   }
+   if ((sinkGiven || (!RECORD && !SERVE)) && sinkStart()) exit(1);
+
+   if (replayName) {
+      i = replayFile(replayName, replaySpeed);
+      fflush(stdout);
+      storeClose();
+      recordClose();
+      sinkClose();
+      ca_task_exit();
+      exit(i ? 1 : 0);
+   }
+
+   if (threads > 1 && shardStart(threads)) exit(1);
+
+   /* add ca monitor for each  PVname on the command line */
+   for (i = 0; i < pvcount; i++) requestMonitor(pvNames[i], CAM_ADD,
+     pvFilters[i]);
 
    /**
    if(!pvcount) {
@@ -482,8 +904,20 @@ int main(int argc,char *argv[])
 
    ca_pend_event(CA_PEND_EVENT_TIME);
 
+   signal(SIGINT,stopHandler);
+   signal(SIGTERM,stopHandler);
+
    /* start  events loop */
-   while(TRUE) {
+   while(!stopRequested) {
       fdmgr_pend_event(pfdctx,&timeout);
+      connectionPoll();
+      if (RECORD) recordPoll();
    }
+
+   shardStop();
+   storeClose();
+   recordClose();
+   if (sinkClose()) raise(stopRequested);
+   ca_task_exit();
+   return(0);
 }
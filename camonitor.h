@@ -0,0 +1,83 @@
+/*************************************************************************\
+* Copyright (c) 2002 The University of Chicago, as Operator of Argonne
+* National Laboratory.
+* Copyright (c) 2002 The Regents of the University of California, as
+* Operator of Los Alamos National Laboratory.
+* This file is distributed subject to a Software License Agreement found
+* in the file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#ifndef INCcamonitorh
+#define INCcamonitorh
+
+/*
+ * $Id$
+ *
+ * Declarations shared by the camonitor source files.
+ */
+
+#include "cadef.h"
+
+#define MAX_CHAN_NAM_LEN 100
+
+#define TRUE            1
+#define FALSE           0
+
+#define CAM_ADD            1
+#define CAM_REMOVE         2
+#define CAM_FILTER         3
+
+struct shard_s;
+struct filter_s;
+
+struct monitor_s {     /* per channel state, ca_puser() and event usr arg */
+  char name[MAX_CHAN_NAM_LEN];
+  dbr_short_t precision;
+  int recordId;         /* record stream, -1 when not recording */
+  int storeId;          /* latest value store entry, -1 until the first */
+  int started;          /* monitor added on first connect */
+  int connected;        /* these two under chanDBLock */
+  epicsTimeStamp since; /* last connection change, or addMonitor */
+  struct shard_s *shard;/* owning shard with -threads, else NULL */
+  struct filter_s *filter;  /* only matching updates are output, or NULL */
+  struct dbr_gr_enum *states;  /* of DBF_ENUM channels, for filters */
+};
+
+struct line_s {        /* output of a formatter, reused from update to update */
+  char *text;
+  size_t len;
+  size_t size;
+};
+
+struct formatter_s {   /* one buffer per output format */
+  struct line_s text;
+  struct line_s binary;
+  struct line_s json;
+};
+
+extern int DEBUG;
+extern int RECORD;
+extern int SERVE;
+
+void processNewEvent(struct event_handler_args args);
+int lineReserve(struct line_s *pline, size_t n);
+void formatText(struct line_s *pline, struct monitor_s *pmon,
+  struct event_handler_args *pargs);
+void addMonitor(char *channelName, struct shard_s *shard,
+  struct filter_s *filter);
+void remMonitor(char *channelName);
+void filterMonitor(char *channelName, struct filter_s *filter);
+
+/* camonitorReplay.c */
+int replayFile(const char *fileName, double speed);
+
+/* camonitorShard.c */
+extern int nShards;
+int  shardStart(int n);
+void shardCommand(char *channelName, int func, struct filter_s *filter);
+void shardOutput(struct shard_s *shard, int format, const char *data,
+  size_t len, const epicsTimeStamp *pstamp);
+struct formatter_s *shardFormatter(struct shard_s *shard);
+void shardStop(void);
+
+#endif /* INCcamonitorh */
@@ -0,0 +1,464 @@
+/*************************************************************************\
+* Copyright (c) 2002 The University of Chicago, as Operator of Argonne
+* National Laboratory.
+* Copyright (c) 2002 The Regents of the University of California, as
+* Operator of Los Alamos National Laboratory.
+* This file is distributed subject to a Software License Agreement found
+* in the file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+/*
+ * $Id$
+ *
+ * Filter expression compiler and evaluator, see camonitorFilter.h.
+ * A recursive descent parser emits postfix code as it goes; && and ||
+ * jump over their right hand side once the result is known.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "cadef.h"
+#include "alarm.h"
+
+#include "camonitor.h"
+#include "camonitorFilter.h"
+
+#define FILTER_STACK        32          /* deepest expression */
+
+enum {
+  OP_CONST,                     /* push arg */
+  OP_VALUE, OP_DELTA, OP_SEVERITY, OP_STATUS, OP_COUNT,
+  OP_CHANGED,                   /* arg is the OP_xxx of the variable */
+  OP_ABS, OP_NEG, OP_NOT,
+  OP_ADD, OP_SUB, OP_MUL, OP_DIV,
+  OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE,
+  OP_AND,                       /* false: 0 and jump to arg, else pop */
+  OP_OR,                        /* true: 1 and jump to arg, else pop */
+  OP_BOOL                       /* 1 or 0 */
+};
+
+struct filterOp_s {
+  int            op;
+  double         arg;
+};
+
+struct filter_s {
+  struct filterOp_s *code;
+  int            nCode;
+  int            capCode;
+
+  int            valid;         /* the previous update, once there is one */
+  double         value;
+  char           string[MAX_STRING_SIZE];  /* of DBR_TIME_STRING updates */
+  int            severity;
+  int            status;
+  long           count;
+};
+
+struct compile_s {
+  const char    *text;
+  const char    *p;
+  struct filter_s *pf;
+  int            depth;
+  int            maxDepth;
+  const char    *error;         /* first error and where */
+  const char    *errorAt;
+};
+
+static const struct {
+  const char    *name;
+  int            op;
+  double         value;         /* of constants */
+} filterNames[] = {
+  {"value",     OP_VALUE,    0},
+  {"delta",     OP_DELTA,    0},
+  {"severity",  OP_SEVERITY, 0},
+  {"status",    OP_STATUS,   0},
+  {"count",     OP_COUNT,    0},
+  {"NO_ALARM",  OP_CONST,    NO_ALARM},
+  {"MINOR",     OP_CONST,    MINOR_ALARM},
+  {"MAJOR",     OP_CONST,    MAJOR_ALARM},
+  {"INVALID",   OP_CONST,    INVALID_ALARM},
+};
+
+#define N_NAMES (sizeof(filterNames) / sizeof(filterNames[0]))
+
+static void parseOr(struct compile_s *pc);
+
+static void compileError(struct compile_s *pc, const char *error)
+{
+  if (pc->error) return;
+  pc->error = error;
+  pc->errorAt = pc->p;
+}
+
+/* Returns the index of the new instruction */
+static int emit(struct compile_s *pc, int op, double arg, int push)
+{
+  struct filter_s *pf = pc->pf;
+
+  if (pf->nCode == pf->capCode) {
+    int cap = pf->capCode ? 2 * pf->capCode : 16;
+    struct filterOp_s *code;
+
+    code = (struct filterOp_s *)realloc(pf->code, cap * sizeof(*code));
+    if (!code) {
+      compileError(pc, "out of memory");
+      return 0;
+    }
+    pf->code = code;
+    pf->capCode = cap;
+  }
+  pf->code[pf->nCode].op = op;
+  pf->code[pf->nCode].arg = arg;
+  pc->depth += push;
+  if (pc->depth > pc->maxDepth) pc->maxDepth = pc->depth;
+  return pf->nCode++;
+}
+
+static void skipSpace(struct compile_s *pc)
+{
+  while (isspace((unsigned char)*pc->p)) pc->p++;
+}
+
+static int acceptToken(struct compile_s *pc, const char *token)
+{
+  size_t n = strlen(token);
+
+  skipSpace(pc);
+  if (strncmp(pc->p, token, n) != 0) return FALSE;
+  pc->p += n;
+  return TRUE;
+}
+
+static void expect(struct compile_s *pc, const char *token)
+{
+  if (!acceptToken(pc, token)) compileError(pc, token[0] == ')' ?
+    "missing )" : "missing (");
+}
+
+/* Length of the name at p, 0 if there is none */
+static size_t nameLength(const char *p)
+{
+  size_t n = 0;
+
+  if (!isalpha((unsigned char)*p) && *p != '_') return 0;
+  while (isalnum((unsigned char)p[n]) || p[n] == '_') n++;
+  return n;
+}
+
+static int isName(const char *p, size_t n, const char *name)
+{
+  return strlen(name) == n && strncmp(p, name, n) == 0;
+}
+
+static void parsePrimary(struct compile_s *pc)
+{
+  const char *name;
+  size_t n, i;
+
+  skipSpace(pc);
+  if (isdigit((unsigned char)*pc->p) || *pc->p == '.') {
+    char *end;
+    double v = strtod(pc->p, &end);
+
+    if (end == pc->p) {
+      compileError(pc, "bad number");
+      return;
+    }
+    pc->p = end;
+    emit(pc, OP_CONST, v, 1);
+    return;
+  }
+  if (acceptToken(pc, "(")) {
+    parseOr(pc);
+    expect(pc, ")");
+    return;
+  }
+
+  name = pc->p;
+  n = nameLength(name);
+  if (!n) {
+    compileError(pc, "expected a value");
+    return;
+  }
+  pc->p += n;
+
+  if (isName(name, n, "abs")) {
+    expect(pc, "(");
+    parseOr(pc);
+    expect(pc, ")");
+    emit(pc, OP_ABS, 0, 0);
+    return;
+  }
+  if (isName(name, n, "changed")) {
+    expect(pc, "(");
+    skipSpace(pc);
+    name = pc->p;
+    n = nameLength(name);
+    for (i = 0; i < N_NAMES; i++) {
+      if (isName(name, n, filterNames[i].name) &&
+          filterNames[i].op != OP_CONST && filterNames[i].op != OP_DELTA)
+        break;
+    }
+    if (i == N_NAMES) {
+      compileError(pc, "changed() takes value, severity, status or count");
+      return;
+    }
+    pc->p += n;
+    expect(pc, ")");
+    emit(pc, OP_CHANGED, filterNames[i].op, 1);
+    return;
+  }
+  for (i = 0; i < N_NAMES; i++) {
+    if (isName(name, n, filterNames[i].name)) {
+      emit(pc, filterNames[i].op, filterNames[i].value, 1);
+      return;
+    }
+  }
+  pc->p = name;
+  compileError(pc, "unknown name");
+}
+
+static void parseUnary(struct compile_s *pc)
+{
+  skipSpace(pc);
+  if (pc->p[0] == '!' && pc->p[1] != '=') {
+    pc->p++;
+    parseUnary(pc);
+    emit(pc, OP_NOT, 0, 0);
+  }
+  else if (acceptToken(pc, "-")) {
+    parseUnary(pc);
+    emit(pc, OP_NEG, 0, 0);
+  }
+  else if (acceptToken(pc, "+")) {
+    parseUnary(pc);
+  }
+  else {
+    parsePrimary(pc);
+  }
+}
+
+static void parseTerm(struct compile_s *pc)
+{
+  parseUnary(pc);
+  for (;;) {
+    if (acceptToken(pc, "*")) {
+      parseUnary(pc);
+      emit(pc, OP_MUL, 0, -1);
+    }
+    else if (acceptToken(pc, "/")) {
+      parseUnary(pc);
+      emit(pc, OP_DIV, 0, -1);
+    }
+    else break;
+  }
+}
+
+static void parseSum(struct compile_s *pc)
+{
+  parseTerm(pc);
+  for (;;) {
+    if (acceptToken(pc, "+")) {
+      parseTerm(pc);
+      emit(pc, OP_ADD, 0, -1);
+    }
+    else if (acceptToken(pc, "-")) {
+      parseTerm(pc);
+      emit(pc, OP_SUB, 0, -1);
+    }
+    else break;
+  }
+}
+
+static void parseCompare(struct compile_s *pc)
+{
+  static const struct {
+    const char *token;
+    int op;
+  } compare[] = {       /* two character operators first */
+    {"==", OP_EQ}, {"!=", OP_NE}, {"<=", OP_LE}, {">=", OP_GE},
+    {"<", OP_LT}, {">", OP_GT}
+  };
+  size_t i;
+
+  parseSum(pc);
+  for (i = 0; i < sizeof(compare) / sizeof(compare[0]); i++) {
+    if (acceptToken(pc, compare[i].token)) {
+      parseSum(pc);
+      emit(pc, compare[i].op, 0, -1);
+      return;
+    }
+  }
+}
+
+static void parseAnd(struct compile_s *pc)
+{
+  parseCompare(pc);
+  while (acceptToken(pc, "&&")) {
+    int jump = emit(pc, OP_AND, 0, -1);
+
+    parseCompare(pc);
+    emit(pc, OP_BOOL, 0, 0);
+    if (!pc->error) pc->pf->code[jump].arg = pc->pf->nCode;
+  }
+}
+
+static void parseOr(struct compile_s *pc)
+{
+  parseAnd(pc);
+  while (acceptToken(pc, "||")) {
+    int jump = emit(pc, OP_OR, 0, -1);
+
+    parseAnd(pc);
+    emit(pc, OP_BOOL, 0, 0);
+    if (!pc->error) pc->pf->code[jump].arg = pc->pf->nCode;
+  }
+}
+
+struct filter_s *filterCompile(const char *text)
+{
+  struct compile_s c;
+
+  memset(&c, 0, sizeof(c));
+  c.text = c.p = text;
+  c.pf = (struct filter_s *)calloc(1, sizeof(struct filter_s));
+  if (!c.pf) {
+    fprintf(stderr, "memory allocation failed\n");
+    return NULL;
+  }
+
+  parseOr(&c);
+  skipSpace(&c);
+  if (*c.p) compileError(&c, "unexpected");
+  if (c.maxDepth > FILTER_STACK) compileError(&c, "too complex");
+  if (c.error) {
+    fprintf(stderr, "Filter \"%s\": %s at \"%s\"\n", text, c.error,
+      c.errorAt);
+    filterFree(c.pf);
+    return NULL;
+  }
+  if (DEBUG) fprintf(stderr, "Filter \"%s\" compiled to %d instructions\n",
+    text, c.pf->nCode);
+  return c.pf;
+}
+
+void filterFree(struct filter_s *pf)
+{
+  if (!pf) return;
+  free(pf->code);
+  free(pf);
+}
+
+/* Enum state index of a string, or the string converted with strtod */
+static double stringValue(const struct event_handler_args *pargs,
+  const char *string)
+{
+  const struct monitor_s *pmon = (const struct monitor_s *)pargs->usr;
+  int i;
+
+  if (pmon && pmon->states) {
+    for (i = 0; i < pmon->states->no_str && i < MAX_ENUM_STATES; i++)
+      if (strncmp(string, pmon->states->strs[i], MAX_ENUM_STRING_SIZE) == 0)
+        return i;
+  }
+  return strtod(string, NULL);
+}
+
+/* The first element as a double, straight from the DBR buffer */
+static double filterValue(const struct event_handler_args *pargs)
+{
+  const void *pvalue = dbr_value_ptr(pargs->dbr, pargs->type);
+
+  if (pargs->count < 1) return 0.0;
+  switch (pargs->type) {
+  case DBR_TIME_STRING: return stringValue(pargs, (const char *)pvalue);
+  case DBR_TIME_SHORT:  return *(const dbr_short_t *)pvalue;
+  case DBR_TIME_FLOAT:  return *(const dbr_float_t *)pvalue;
+  case DBR_TIME_ENUM:   return *(const dbr_enum_t *)pvalue;
+  case DBR_TIME_CHAR:   return *(const dbr_char_t *)pvalue;
+  case DBR_TIME_LONG:   return *(const dbr_long_t *)pvalue;
+  case DBR_TIME_DOUBLE: return *(const dbr_double_t *)pvalue;
+  }
+  return 0.0;
+}
+
+int filterMatch(struct filter_s *pf, const struct event_handler_args *pargs)
+{
+  const struct dbr_time_string *pdbr =
+    (const struct dbr_time_string *)pargs->dbr;
+  const struct filterOp_s *op;
+  double stack[FILTER_STACK];
+  double value = filterValue(pargs);
+  const char *string = "";
+  int sp = 0;
+  int i, match;
+
+  if (pargs->type == DBR_TIME_STRING && pargs->count > 0)
+    string = (const char *)dbr_value_ptr(pargs->dbr, pargs->type);
+
+  for (i = 0; i < pf->nCode; i++) {
+    op = &pf->code[i];
+    switch (op->op) {
+    case OP_CONST:    stack[sp++] = op->arg; break;
+    case OP_VALUE:    stack[sp++] = value; break;
+    case OP_DELTA:    stack[sp++] = pf->valid ? value - pf->value : 0.0; break;
+    case OP_SEVERITY: stack[sp++] = pdbr->severity; break;
+    case OP_STATUS:   stack[sp++] = pdbr->status; break;
+    case OP_COUNT:    stack[sp++] = pargs->count; break;
+    case OP_CHANGED:
+      switch ((int)op->arg) {
+      case OP_VALUE:
+        match = pargs->type == DBR_TIME_STRING ?
+          strncmp(string, pf->string, MAX_STRING_SIZE) != 0 :
+          value != pf->value;
+        break;
+      case OP_SEVERITY: match = pdbr->severity != pf->severity; break;
+      case OP_STATUS:   match = pdbr->status != pf->status; break;
+      default:          match = pargs->count != pf->count; break;
+      }
+      stack[sp++] = !pf->valid || match;
+      break;
+    case OP_ABS:      stack[sp-1] = fabs(stack[sp-1]); break;
+    case OP_NEG:      stack[sp-1] = -stack[sp-1]; break;
+    case OP_NOT:      stack[sp-1] = stack[sp-1] == 0.0; break;
+    case OP_BOOL:     stack[sp-1] = stack[sp-1] != 0.0; break;
+    case OP_ADD: sp--; stack[sp-1] = stack[sp-1] + stack[sp]; break;
+    case OP_SUB: sp--; stack[sp-1] = stack[sp-1] - stack[sp]; break;
+    case OP_MUL: sp--; stack[sp-1] = stack[sp-1] * stack[sp]; break;
+    case OP_DIV: sp--; stack[sp-1] = stack[sp-1] / stack[sp]; break;
+    case OP_EQ:  sp--; stack[sp-1] = stack[sp-1] == stack[sp]; break;
+    case OP_NE:  sp--; stack[sp-1] = stack[sp-1] != stack[sp]; break;
+    case OP_LT:  sp--; stack[sp-1] = stack[sp-1] <  stack[sp]; break;
+    case OP_LE:  sp--; stack[sp-1] = stack[sp-1] <= stack[sp]; break;
+    case OP_GT:  sp--; stack[sp-1] = stack[sp-1] >  stack[sp]; break;
+    case OP_GE:  sp--; stack[sp-1] = stack[sp-1] >= stack[sp]; break;
+    case OP_AND:
+      if (stack[sp-1] == 0.0) i = (int)op->arg - 1;
+      else sp--;
+      break;
+    case OP_OR:
+      if (stack[sp-1] != 0.0) {
+        stack[sp-1] = 1.0;
+        i = (int)op->arg - 1;
+      }
+      else sp--;
+      break;
+    }
+  }
+  match = sp > 0 && stack[sp-1] != 0.0;
+
+  pf->valid = TRUE;
+  pf->value = value;
+  if (pargs->type == DBR_TIME_STRING)
+    strncpy(pf->string, string, MAX_STRING_SIZE);
+  pf->severity = pdbr->severity;
+  pf->status = pdbr->status;
+  pf->count = pargs->count;
+  return match;
+}
@@ -0,0 +1,54 @@
+/*************************************************************************\
+* Copyright (c) 2002 The University of Chicago, as Operator of Argonne
+* National Laboratory.
+* Copyright (c) 2002 The Regents of the University of California, as
+* Operator of Los Alamos National Laboratory.
+* This file is distributed subject to a Software License Agreement found
+* in the file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#ifndef INCcamonitorFilterh
+#define INCcamonitorFilterh
+
+/*
+ * $Id$
+ *
+ * Per PV filter expressions.  An expression is compiled once, when it is
+ * attached to a PV, into code for a small stack machine.  processNewEvent
+ * runs it on the DBR_TIME_xxx buffer of every update, before anything is
+ * formatted, and only updates for which it is true are output.
+ *
+ *   value > 3.2 && severity >= MINOR
+ *   abs(delta) > 0.5
+ *   changed(severity)
+ *
+ *   value       first element; enums, monitored as strings, give the
+ *               index of their state and other strings are converted
+ *               with strtod
+ *   delta       value minus the value of the previous update, 0 at first
+ *   severity    alarm severity, compare with NO_ALARM MINOR MAJOR INVALID
+ *   status      alarm status
+ *   count       number of elements
+ *   abs(x)
+ *   changed(v)  true when v, one of the four above, differs from the
+ *               previous update, and for the first update.  The value of
+ *               strings and enums is compared as a string.
+ *
+ * Operators, loosest first, are || && then == != < <= > >= then + - then
+ * * / and the unary ! -.  Numbers are decimal with an optional fraction and
+ * exponent.  Non zero is true, comparisons and logical operators give 1 or 0.
+ *
+ * The previous update is the previous one received, whether it matched or
+ * not, so each filter_s belongs to a single PV.
+ */
+
+#include "cadef.h"
+
+struct filter_s;
+
+/* Returns NULL after printing the error for an invalid expression */
+struct filter_s *filterCompile(const char *text);
+int  filterMatch(struct filter_s *pf, const struct event_handler_args *pargs);
+void filterFree(struct filter_s *pf);
+
+#endif /* INCcamonitorFilterh */
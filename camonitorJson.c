@@ -0,0 +1,192 @@
+/*************************************************************************\
+* Copyright (c) 2002 The University of Chicago, as Operator of Argonne
+* National Laboratory.
+* Copyright (c) 2002 The Regents of the University of California, as
+* Operator of Los Alamos National Laboratory.
+* This file is distributed subject to a Software License Agreement found
+* in the file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+/*
+ * $Id$
+ *
+ * NDJSON formatter, one object per update:
+ *
+ *   {"name":"PV","time":1431442800.123456789,"type":"DOUBLE",
+ *    "value":1.25,"status":"NO_ALARM","severity":"NO_ALARM"}
+ *
+ * Arrays give "value":[...] and "count".  time is seconds since 1970.
+ * Floating point values use the PV's display precision; NaN and
+ * infinities, which JSON cannot express, are written as null.
+ *
+ * The worst case size of the object is reserved up front and everything
+ * is then written straight into the buffer, numbers with the cvtFast
+ * conversions (which only fall back to sprintf for huge values or more
+ * than 8 digits of precision).  Once the buffer has grown to the largest
+ * update seen, formatting an update does not allocate.
+ */
+
+#include <string.h>
+
+#include "cadef.h"
+#include "cvtFast.h"
+#include "alarm.h"
+#include "alarmString.h"
+#include "epicsTime.h"
+
+#include "camonitor.h"
+#include "camonitorSink.h"
+
+#define JSON_FIXED          256     /* keys, time, type, alarm strings */
+#define JSON_NUMBER         40      /* longest cvtXxxToString result */
+
+static const char *jsonType[] = {   /* by DBR_TIME_xxx - DBR_TIME_STRING */
+  "STRING", "SHORT", "FLOAT", "ENUM", "CHAR", "LONG", "DOUBLE"
+};
+
+static char *jsonString(char *p, const char *s, size_t max)
+{
+  static const char hex[] = "0123456789abcdef";
+
+  *p++ = '"';
+  for (; max && *s; max--, s++) {
+    unsigned char c = (unsigned char)*s;
+
+    if (c == '"' || c == '\\') {
+      *p++ = '\\';
+      *p++ = c;
+    }
+    else if (c < 0x20) {
+      *p++ = '\\';
+      *p++ = 'u';
+      *p++ = '0';
+      *p++ = '0';
+      *p++ = hex[c >> 4];
+      *p++ = hex[c & 15];
+    }
+    else {
+      *p++ = c;
+    }
+  }
+  *p++ = '"';
+  return p;
+}
+
+static char *jsonLiteral(char *p, const char *s)
+{
+  while (*s) *p++ = *s++;
+  return p;
+}
+
+static char *jsonUnsigned(char *p, epicsUInt32 v, int digits)
+{
+  char tmp[10];
+  int n = 0;
+
+  do {
+    tmp[n++] = (char)('0' + v % 10);
+    v /= 10;
+  } while (v || n < digits);
+  while (n) *p++ = tmp[--n];
+  return p;
+}
+
+static char *jsonDouble(char *p, double v, int precision)
+{
+  if (v != v || v - v != 0.0) return jsonLiteral(p, "null");
+  return p + cvtDoubleToString(v, p, (unsigned short)precision);
+}
+
+static char *jsonValue(char *p, int type, const void *pvalue, long i,
+  int precision)
+{
+  switch (type) {
+  case DBR_TIME_STRING:
+    return jsonString(p, (const char *)pvalue + i * MAX_STRING_SIZE,
+      MAX_STRING_SIZE);
+  case DBR_TIME_ENUM:
+    return jsonUnsigned(p, ((const dbr_enum_t *)pvalue)[i], 1);
+  case DBR_TIME_SHORT:
+    return p + cvtLongToString(((const dbr_short_t *)pvalue)[i], p);
+  case DBR_TIME_FLOAT:
+    return jsonDouble(p, ((const dbr_float_t *)pvalue)[i], precision);
+  case DBR_TIME_CHAR:
+    return jsonUnsigned(p, ((const dbr_char_t *)pvalue)[i], 1);
+  case DBR_TIME_LONG:
+    return p + cvtLongToString(((const dbr_long_t *)pvalue)[i], p);
+  case DBR_TIME_DOUBLE:
+    return jsonDouble(p, ((const dbr_double_t *)pvalue)[i], precision);
+  }
+  return jsonLiteral(p, "null");
+}
+
+void sinkFormatJson(struct line_s *pline, const struct monitor_s *pmon,
+  const struct event_handler_args *pargs)
+{
+  const struct dbr_time_string *pdbr =
+    (const struct dbr_time_string *)pargs->dbr;
+  const void *pvalue = dbr_value_ptr(pargs->dbr, pargs->type);
+  int type = (int)pargs->type;
+  long count = pargs->count;
+  int status = pdbr->status, severity = pdbr->severity;
+  size_t perValue = type == DBR_TIME_STRING ? 6 * MAX_STRING_SIZE + 3 :
+    JSON_NUMBER;
+  char *p;
+  long i;
+
+  pline->len = 0;
+  if (type < DBR_TIME_STRING || type > DBR_TIME_DOUBLE) return;
+  if (lineReserve(pline, JSON_FIXED + 6 * strlen(pmon->name) +
+        (count + 1) * perValue)) return;
+  p = pline->text;
+
+  p = jsonLiteral(p, "{\"name\":");
+  p = jsonString(p, pmon->name, MAX_CHAN_NAM_LEN);
+  p = jsonLiteral(p, ",\"time\":");
+  p = jsonUnsigned(p, pdbr->stamp.secPastEpoch + POSIX_TIME_AT_EPICS_EPOCH, 1);
+  *p++ = '.';
+  p = jsonUnsigned(p, pdbr->stamp.nsec, 9);
+  p = jsonLiteral(p, ",\"type\":\"");
+  p = jsonLiteral(p, jsonType[type - DBR_TIME_STRING]);
+  p = jsonLiteral(p, "\",\"value\":");
+  if (count == 1) {
+    p = jsonValue(p, type, pvalue, 0, pmon->precision);
+  }
+  else {
+    *p++ = '[';
+    for (i = 0; i < count; i++) {
+      if (i) *p++ = ',';
+      p = jsonValue(p, type, pvalue, i, pmon->precision);
+    }
+    *p++ = ']';
+    p = jsonLiteral(p, ",\"count\":");
+    p = jsonUnsigned(p, (epicsUInt32)count, 1);
+  }
+  p = jsonLiteral(p, ",\"status\":\"");
+  p = jsonLiteral(p, status >= 0 && status < ALARM_NSTATUS ?
+    alarmStatusString[status] : "UNKNOWN");
+  p = jsonLiteral(p, "\",\"severity\":\"");
+  p = jsonLiteral(p, severity >= 0 && severity < ALARM_NSEV ?
+    alarmSeverityString[severity] : "UNKNOWN");
+  p = jsonLiteral(p, "\"}\n");
+
+  pline->len = p - pline->text;
+}
+
+/* {"name":"PV","error":"..."} for a PV without a value */
+void sinkFormatJsonError(struct line_s *pline, const char *name,
+  const char *error)
+{
+  char *p;
+
+  pline->len = 0;
+  if (lineReserve(pline, JSON_FIXED + 6 * strlen(name) + strlen(error)))
+    return;
+  p = pline->text;
+  p = jsonLiteral(p, "{\"name\":");
+  p = jsonString(p, name, MAX_CHAN_NAM_LEN);
+  p = jsonLiteral(p, ",\"error\":\"");
+  p = jsonLiteral(p, error);
+  p = jsonLiteral(p, "\"}\n");
+  pline->len = p - pline->text;
+}
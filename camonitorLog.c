@@ -0,0 +1,494 @@
+/*************************************************************************\
+* Copyright (c) 2002 The University of Chicago, as Operator of Argonne
+* National Laboratory.
+* Copyright (c) 2002 The Regents of the University of California, as
+* Operator of Los Alamos National Laboratory.
+* This file is distributed subject to a Software License Agreement found
+* in the file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+/*
+ * $Id$
+ *
+ * Compressed, rotating text log.  See camonitorLog.h for the file layout.
+ *
+ * The compressor is a plain greedy LZ4 block compressor: one hash table
+ * probe per position, no dictionary between blocks.  That is about the
+ * speed of LZ4's default level and keeps every block independently
+ * decodable, which the seek index relies on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#include "epicsTypes.h"
+#include "epicsTime.h"
+#include "epicsThread.h"
+#include "epicsMutex.h"
+#include "epicsEvent.h"
+
+#include "camonitor.h"
+#include "camonitorLog.h"
+
+#define LZ4_FRAME_MAGIC     0x184D2204
+#define LZ4_SKIP_MAGIC      0x184D2A50
+#define LZ4_FLG             0x60        /* version 01, independent blocks */
+#define LZ4_BD              0x50        /* 256 KB maximum block size */
+#define LZ4_UNCOMPRESSED    0x80000000  /* block size flag */
+
+#define LZ4_MINMATCH        4
+#define LZ4_LASTLITERALS    5
+#define LZ4_MFLIMIT         12
+#define LZ4_MAX_DISTANCE    65535
+#define LZ4_HASH_LOG        14
+
+#define XXH_PRIME1          2654435761U
+#define XXH_PRIME2          2246822519U
+#define XXH_PRIME3          3266489917U
+#define XXH_PRIME5          374761393U
+
+#define NO_LINE             0xffffffff
+
+struct logBlock_s {
+  char          *data;
+  size_t         len;
+  epicsUInt32    firstLine;     /* NO_LINE until a line starts here */
+  epicsTimeStamp first;         /* of the first line written */
+  epicsTimeStamp opened;        /* wall clock, for LOG_FLUSH_SECONDS */
+};
+
+struct logIndex_s {
+  epicsTimeStamp first;
+  size_t         offset;
+  epicsUInt32    size;
+  epicsUInt32    firstLine;
+};
+
+/* shared between logWrite and the log thread, protected by logLock */
+static epicsMutexId logLock;
+static epicsEventId logWakeup;
+static epicsEventId logDone;
+static struct logBlock_s logBlocks[LOG_QUEUE_BLOCKS];
+static int logFill;                 /* block being filled */
+static int logNFull;                /* blocks queued before logFill */
+static int logStop;
+static unsigned long logDropped;
+
+/* owned by the log thread */
+static const char *logBase;
+static double logRotateBytes;
+static double logRotateSeconds;
+static FILE *logFile;
+static size_t logOffset;
+static epicsTimeStamp logOpened;
+static struct logIndex_s *logIndex;
+static size_t logNIndex;
+static size_t logIndexCap;
+static epicsUInt32 *lz4Table;
+static unsigned char *lz4Buf;
+
+static void putLE32(unsigned char *p, epicsUInt32 v)
+{
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  p[3] = (unsigned char)(v >> 24);
+}
+
+static epicsUInt32 read32(const unsigned char *p)
+{
+  epicsUInt32 v;
+
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static epicsUInt32 rotl32(epicsUInt32 v, int r)
+{
+  return (v << r) | (v >> (32 - r));
+}
+
+/* XXH32 with seed 0 for inputs shorter than 16 bytes (frame header) */
+static epicsUInt32 xxh32Short(const unsigned char *p, size_t len)
+{
+  epicsUInt32 h = XXH_PRIME5 + (epicsUInt32)len;
+
+  while (len--) {
+    h += (*p++) * XXH_PRIME5;
+    h = rotl32(h, 11) * XXH_PRIME1;
+  }
+  h ^= h >> 15;
+  h *= XXH_PRIME2;
+  h ^= h >> 13;
+  h *= XXH_PRIME3;
+  h ^= h >> 16;
+  return h;
+}
+
+static unsigned char *lz4Length(unsigned char *op, size_t len)
+{
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (unsigned char)len;
+  return op;
+}
+
+/*
+ * Compress src into dst using the LZ4 block format.  Returns the
+ * compressed size, or 0 if it would not fit in dstCap.
+ */
+static size_t lz4Compress(const unsigned char *src, size_t srcLen,
+  unsigned char *dst, size_t dstCap, epicsUInt32 *table)
+{
+  const unsigned char *ip = src, *anchor = src;
+  const unsigned char *iend = src + srcLen;
+  const unsigned char *mflimit = iend - LZ4_MFLIMIT;
+  const unsigned char *matchlimit = iend - LZ4_LASTLITERALS;
+  unsigned char *op = dst, *oend = dst + dstCap;
+  size_t litLen;
+
+  memset(table, 0, sizeof(epicsUInt32) << LZ4_HASH_LOG);
+
+  if (srcLen > LZ4_MFLIMIT) {
+    ip++;
+    while (ip < mflimit) {
+      epicsUInt32 h = (read32(ip) * XXH_PRIME1) >> (32 - LZ4_HASH_LOG);
+      const unsigned char *ref = src + table[h];
+      unsigned char *token;
+      size_t len;
+
+      table[h] = (epicsUInt32)(ip - src);
+      if (ref >= ip || ip - ref > LZ4_MAX_DISTANCE ||
+          read32(ref) != read32(ip)) {
+        ip += 1 + ((ip - anchor) >> 6);
+        continue;
+      }
+
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      len = LZ4_MINMATCH;
+      while (ip + len < matchlimit && ip[len] == ref[len]) len++;
+
+      litLen = ip - anchor;
+      if (op + 1 + litLen/255 + 1 + litLen + 2 +
+          (len - LZ4_MINMATCH)/255 + 1 > oend) return 0;
+      token = op++;
+      if (litLen >= 15) {
+        *token = 15 << 4;
+        op = lz4Length(op, litLen - 15);
+      }
+      else {
+        *token = (unsigned char)(litLen << 4);
+      }
+      memcpy(op, anchor, litLen);
+      op += litLen;
+      *op++ = (unsigned char)(ip - ref);
+      *op++ = (unsigned char)((ip - ref) >> 8);
+      if (len - LZ4_MINMATCH >= 15) {
+        *token |= 15;
+        op = lz4Length(op, len - LZ4_MINMATCH - 15);
+      }
+      else {
+        *token |= (unsigned char)(len - LZ4_MINMATCH);
+      }
+
+      ip += len;
+      anchor = ip;
+      table[(read32(ip - 2) * XXH_PRIME1) >> (32 - LZ4_HASH_LOG)] =
+        (epicsUInt32)(ip - 2 - src);
+    }
+  }
+
+  litLen = iend - anchor;
+  if (op + 1 + litLen/255 + 1 + litLen > oend) return 0;
+  if (litLen >= 15) {
+    *op++ = 15 << 4;
+    op = lz4Length(op, litLen - 15);
+  }
+  else {
+    *op++ = (unsigned char)(litLen << 4);
+  }
+  memcpy(op, anchor, litLen);
+  op += litLen;
+  return op - dst;
+}
+
+static int logOpenFile(void)
+{
+  unsigned char header[7];
+  char fileName[1024];
+  char stamp[32];
+  time_t now;
+  int seq = 0;
+  int fd;
+
+  time(&now);
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+  sprintf(fileName, "%.*s-%s.lz4", (int)(sizeof(fileName) - 64), logBase,
+    stamp);
+  /* rotating more than once a second, or another logger with the same
+     base, must not overwrite */
+  while ((fd = open(fileName, O_WRONLY|O_CREAT|O_EXCL|O_BINARY, 0666)) < 0 &&
+         errno == EEXIST)
+    sprintf(fileName, "%.*s-%s-%d.lz4", (int)(sizeof(fileName) - 64),
+      logBase, stamp, ++seq);
+
+  logFile = fd < 0 ? NULL : fdopen(fd, "wb");
+  if (!logFile) {
+    fprintf(stderr, "Unable to create log file %s\n", fileName);
+    perror("open");
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+
+  putLE32(header, LZ4_FRAME_MAGIC);
+  header[4] = LZ4_FLG;
+  header[5] = LZ4_BD;
+  header[6] = (unsigned char)(xxh32Short(header + 4, 2) >> 8);
+  fwrite(header, 1, sizeof(header), logFile);
+  logOffset = sizeof(header);
+  logNIndex = 0;
+  epicsTimeGetCurrent(&logOpened);
+  if (DEBUG) fprintf(stderr, "logging to %s\n", fileName);
+  return 0;
+}
+
+/* End the frame and append the block index as a skippable frame */
+static void logCloseFile(void)
+{
+  unsigned char word[4];
+  unsigned char entry[24];
+  size_t i;
+
+  if (!logFile) return;
+
+  putLE32(word, 0);                 /* EndMark */
+  fwrite(word, 1, 4, logFile);
+
+  putLE32(word, LZ4_SKIP_MAGIC);
+  fwrite(word, 1, 4, logFile);
+  putLE32(word, (epicsUInt32)(logNIndex * sizeof(entry) + 8));
+  fwrite(word, 1, 4, logFile);
+  for (i = 0; i < logNIndex; i++) {
+    putLE32(entry, logIndex[i].first.secPastEpoch);
+    putLE32(entry + 4, logIndex[i].first.nsec);
+    putLE32(entry + 8, (epicsUInt32)logIndex[i].offset);
+    putLE32(entry + 12, (epicsUInt32)((logIndex[i].offset >> 16) >> 16));
+    putLE32(entry + 16, logIndex[i].size);
+    putLE32(entry + 20, logIndex[i].firstLine);
+    fwrite(entry, 1, sizeof(entry), logFile);
+  }
+  putLE32(word, (epicsUInt32)logNIndex);
+  fwrite(word, 1, 4, logFile);
+  fwrite(LOG_INDEX_MAGIC, 1, 4, logFile);
+
+  if (fclose(logFile) != 0) perror("Unable to close log file");
+  logFile = NULL;
+}
+
+static void logWriteBlock(struct logBlock_s *pb)
+{
+  unsigned char word[4];
+  size_t size;
+
+  if (logFile) {
+    epicsTimeStamp now;
+
+    epicsTimeGetCurrent(&now);
+    if ((logRotateBytes > 0 && logOffset >= logRotateBytes) ||
+        (logRotateSeconds > 0 &&
+         epicsTimeDiffInSeconds(&now, &logOpened) >= logRotateSeconds)) {
+      logCloseFile();
+    }
+  }
+  if (!logFile && logOpenFile()) return;
+
+  if (logNIndex == logIndexCap) {
+    size_t cap = logIndexCap ? 2 * logIndexCap : 256;
+    struct logIndex_s *p = (struct logIndex_s *)realloc(logIndex,
+      cap * sizeof(*p));
+
+    if (p) {
+      logIndex = p;
+      logIndexCap = cap;
+    }
+  }
+  if (logNIndex < logIndexCap) {
+    logIndex[logNIndex].first = pb->first;
+    logIndex[logNIndex].offset = logOffset;
+    logIndex[logNIndex].size = (epicsUInt32)pb->len;
+    logIndex[logNIndex].firstLine = pb->firstLine;
+    logNIndex++;
+  }
+
+  size = lz4Compress((const unsigned char *)pb->data, pb->len, lz4Buf,
+    pb->len - 1, lz4Table);
+  if (size) {
+    putLE32(word, (epicsUInt32)size);
+    fwrite(word, 1, 4, logFile);
+    fwrite(lz4Buf, 1, size, logFile);
+  }
+  else {
+    size = pb->len;
+    putLE32(word, (epicsUInt32)size | LZ4_UNCOMPRESSED);
+    fwrite(word, 1, 4, logFile);
+    fwrite(pb->data, 1, size, logFile);
+  }
+  logOffset += 4 + size;
+  if (fflush(logFile) != 0 || ferror(logFile)) {
+    perror("Unable to write log file");
+    clearerr(logFile);
+  }
+}
+
+/* Queue the block being filled, called with logLock held */
+static void queueFill(void)
+{
+  logNFull++;
+  logFill = (logFill + 1) % LOG_QUEUE_BLOCKS;
+  logBlocks[logFill].len = 0;
+  logBlocks[logFill].firstLine = NO_LINE;
+}
+
+static void logThread(void *notused)
+{
+  epicsMutexMustLock(logLock);
+  for (;;) {
+    struct logBlock_s *pb;
+
+    if (!logNFull && logBlocks[logFill].len) {
+      epicsTimeStamp now;
+
+      epicsTimeGetCurrent(&now);
+      if (logStop || epicsTimeDiffInSeconds(&now,
+          &logBlocks[logFill].opened) >= LOG_FLUSH_SECONDS) {
+        queueFill();
+      }
+    }
+    if (!logNFull) {
+      if (logStop) break;
+      epicsMutexUnlock(logLock);
+      epicsEventWaitWithTimeout(logWakeup, LOG_FLUSH_SECONDS / 2);
+      epicsMutexMustLock(logLock);
+      continue;
+    }
+
+    pb = &logBlocks[(logFill - logNFull + LOG_QUEUE_BLOCKS) % LOG_QUEUE_BLOCKS];
+    epicsMutexUnlock(logLock);
+    logWriteBlock(pb);
+    epicsMutexMustLock(logLock);
+    logNFull--;
+  }
+  epicsMutexUnlock(logLock);
+
+  logCloseFile();
+  epicsEventSignal(logDone);
+}
+
+int logOpen(const char *base, double rotateBytes, double rotateSeconds)
+{
+  int i;
+
+  logBase = base;
+  logRotateBytes = rotateBytes;
+  logRotateSeconds = rotateSeconds;
+
+  lz4Table = (epicsUInt32 *)malloc(sizeof(epicsUInt32) << LZ4_HASH_LOG);
+  lz4Buf = (unsigned char *)malloc(LOG_BLOCK_SIZE);
+  for (i = 0; i < LOG_QUEUE_BLOCKS; i++) {
+    logBlocks[i].data = (char *)malloc(LOG_BLOCK_SIZE);
+    if (!logBlocks[i].data) break;
+  }
+  if (!lz4Table || !lz4Buf || i < LOG_QUEUE_BLOCKS) {
+    fprintf(stderr, "memory allocation failed\n");
+    return -1;
+  }
+  logBlocks[0].firstLine = NO_LINE;
+
+  if (logOpenFile()) return -1;
+
+  logLock = epicsMutexMustCreate();
+  logWakeup = epicsEventMustCreate(epicsEventEmpty);
+  logDone = epicsEventMustCreate(epicsEventEmpty);
+  if (!epicsThreadCreate("camonitorLog", epicsThreadPriorityLow,
+        epicsThreadGetStackSize(epicsThreadStackMedium), logThread, NULL)) {
+    fprintf(stderr, "Unable to start log thread\n");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Copy a line into the current block.  Never waits for the log thread:
+ * when every block is queued the line is dropped.
+ */
+void logWrite(const char *text, size_t len, const epicsTimeStamp *pstamp)
+{
+  int lineStart = TRUE;
+
+  epicsMutexMustLock(logLock);
+  if (len > (LOG_BLOCK_SIZE - logBlocks[logFill].len) +
+      (size_t)(LOG_QUEUE_BLOCKS - 1 - logNFull) * LOG_BLOCK_SIZE) {
+    logDropped++;
+    epicsMutexUnlock(logLock);
+    return;
+  }
+  while (len) {
+    struct logBlock_s *pb = &logBlocks[logFill];
+    size_t n;
+
+    if (pb->len == LOG_BLOCK_SIZE) {
+      queueFill();
+      epicsEventSignal(logWakeup);
+      continue;
+    }
+    if (!pb->len) {
+      pb->first = *pstamp;
+      epicsTimeGetCurrent(&pb->opened);
+    }
+    if (lineStart && pb->firstLine == NO_LINE)
+      pb->firstLine = (epicsUInt32)pb->len;
+    lineStart = FALSE;
+
+    n = LOG_BLOCK_SIZE - pb->len;
+    if (n > len) n = len;
+    memcpy(pb->data + pb->len, text, n);
+    pb->len += n;
+    text += n;
+    len -= n;
+  }
+  epicsMutexUnlock(logLock);
+}
+
+void logClose(void)
+{
+  if (!logLock) return;
+
+  epicsMutexMustLock(logLock);
+  logStop = TRUE;
+  epicsMutexUnlock(logLock);
+  epicsEventSignal(logWakeup);
+  epicsEventMustWait(logDone);
+
+  if (logDropped)
+    fprintf(stderr, "%lu log lines dropped, log writer could not keep up\n",
+      logDropped);
+}
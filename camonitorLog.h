@@ -0,0 +1,60 @@
+/*************************************************************************\
+* Copyright (c) 2002 The University of Chicago, as Operator of Argonne
+* National Laboratory.
+* Copyright (c) 2002 The Regents of the University of California, as
+* Operator of Los Alamos National Laboratory.
+* This file is distributed subject to a Software License Agreement found
+* in the file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#ifndef INCcamonitorLogh
+#define INCcamonitorLogh
+
+/*
+ * $Id$
+ *
+ * Compressed, rotating text log used by "camonitor -log base".
+ *
+ * Output lines are collected into 256 KB blocks which a background thread
+ * compresses and writes, so the CA callbacks only ever copy into memory.
+ * If the thread falls behind and all LOG_QUEUE_BLOCKS blocks are waiting,
+ * new lines are dropped and counted rather than blocking the caller.
+ *
+ * Each file, named base-YYYYMMDD-HHMMSS.lz4 (with -n appended to the name
+ * when several are started in the same second), is a standard LZ4 frame with
+ * independently compressed blocks, so "lz4 -d" decompresses it.  The frame
+ * is followed by an LZ4 skippable frame (magic 0x184D2A50) holding an
+ * index of the blocks, all fields little endian:
+ *
+ *   entry[n]:  epicsUInt32 secPastEpoch, nsec    first line in the block
+ *              epicsUInt32 offsetLow, offsetHigh  of the block size field
+ *              epicsUInt32 size                   uncompressed bytes
+ *              epicsUInt32 firstLine              offset of the first line
+ *                                                 starting in the block,
+ *                                                 0xffffffff if none
+ *   epicsUInt32 n
+ *   char        magic[4] = "CAMI"
+ *
+ * A reader finds the index from the last 8 bytes of the file, then seeks
+ * straight to the block covering a time and decompresses from there.
+ */
+
+#include <stddef.h>
+
+#include "epicsTime.h"
+
+#define LOG_BLOCK_SIZE      (256*1024)  /* LZ4 block maximum size 256 KB */
+#define LOG_QUEUE_BLOCKS    16
+#define LOG_FLUSH_SECONDS   2.0         /* partial blocks are written after */
+#define LOG_INDEX_MAGIC     "CAMI"
+
+/*
+ * rotateBytes and rotateSeconds start a new file once the current one has
+ * that much compressed data or age, 0 disables either limit.
+ * logOpen returns 0, or -1 after printing the reason.
+ */
+int  logOpen(const char *base, double rotateBytes, double rotateSeconds);
+void logWrite(const char *text, size_t len, const epicsTimeStamp *pstamp);
+void logClose(void);
+
+#endif /* INCcamonitorLogh */
@@ -0,0 +1,290 @@
+/*************************************************************************\
+* Copyright (c) 2002 The University of Chicago, as Operator of Argonne
+* National Laboratory.
+* Copyright (c) 2002 The Regents of the University of California, as
+* Operator of Los Alamos National Laboratory.
+* This file is distributed subject to a Software License Agreement found
+* in the file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+/*
+ * $Id$
+ *
+ * camonitorread - extract PVs from a file written by "camonitor -record".
+ *
+ * The file is mapped into memory and only the chunk indexes are looked at
+ * until a block of the requested PV overlaps the requested time window.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "cvtFast.h"
+#include "db_access.h"
+#include "alarm.h"
+#include "alarmString.h"
+#include "epicsTime.h"
+
+#include "camonitorRecord.h"
+#include "camonitorVersion.h"
+
+#define TRUE            1
+#define FALSE           0
+
+struct pvSummary_s {
+  const char    *name;
+  int            dbrType;
+  unsigned long  nSamples;
+  epicsTimeStamp first;
+  epicsTimeStamp last;
+};
+
+/*
+ * Accepts seconds since 1970 or a local time "YYYY-MM-DD HH:MM:SS".
+ * The separator may also be a 'T'.
+ */
+static int parseTime(const char *text, epicsTimeStamp *pstamp)
+{
+  struct tm tm;
+  double seconds;
+  char extra;
+
+  memset(&tm, 0, sizeof(tm));
+  if (sscanf(text, "%d-%d-%d%*c%d:%d:%lf", &tm.tm_year, &tm.tm_mon,
+        &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &seconds) == 6) {
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_sec = (int)seconds;
+    tm.tm_isdst = -1;
+    epicsTimeFromTime_t(pstamp, mktime(&tm));
+    pstamp->nsec = (epicsUInt32)((seconds - tm.tm_sec) * 1e9);
+    return 0;
+  }
+  if (sscanf(text, "%lf%c", &seconds, &extra) == 1) {
+    epicsTimeFromTime_t(pstamp, (time_t)seconds);
+    pstamp->nsec = (epicsUInt32)((seconds - (time_t)seconds) * 1e9);
+    return 0;
+  }
+  fprintf(stderr, "Bad time \"%s\"\n", text);
+  return -1;
+}
+
+static void printSample(const char *name, int type, int precision,
+  const epicsTimeStamp *pstamp, int status, int severity,
+  long count, const char *pvalue)
+{
+  char timeText[28];
+  char string[MAX_STRING_SIZE];
+  long i;
+
+  epicsTimeToStrftime(timeText, 28, "%m/%d/%y %H:%M:%S.%09f", pstamp);
+  printf(" %-30s %s ", name, timeText);
+
+  for (i = 0; i < count; i++) {
+    if (count != 1 && (i%10 == 0)) printf("\n");
+    switch (type) {
+    case DBR_TIME_STRING:
+      printf("%.*s ", MAX_STRING_SIZE, pvalue + i * MAX_STRING_SIZE);
+      break;
+    case DBR_TIME_ENUM:
+      printf("%d ", ((const dbr_enum_t *)pvalue)[i]);
+      break;
+    case DBR_TIME_SHORT:
+      printf("%d ", ((const dbr_short_t *)pvalue)[i]);
+      break;
+    case DBR_TIME_FLOAT:
+      cvtFloatToString(((const dbr_float_t *)pvalue)[i], string, precision);
+      printf("%s ", string);
+      break;
+    case DBR_TIME_CHAR:
+      printf("%d ", (short)((const dbr_char_t *)pvalue)[i]);
+      break;
+    case DBR_TIME_LONG:
+      printf("%d ", ((const dbr_long_t *)pvalue)[i]);
+      break;
+    case DBR_TIME_DOUBLE:
+      cvtDoubleToString(((const dbr_double_t *)pvalue)[i], string, precision);
+      printf("%s ", string);
+      break;
+    }
+  }
+
+  if (severity && severity < ALARM_NSEV && status < ALARM_NSTATUS)
+    printf(" %s %s", alarmStatusString[status], alarmSeverityString[severity]);
+  printf("\n");
+}
+
+static void extract(const char *base, size_t size, const char *pvName,
+  const epicsTimeStamp *pstart, const epicsTimeStamp *pend)
+{
+  const struct camrChunkHeader *pchunk;
+  size_t offset = 0;
+
+  while ((pchunk = camrNextChunk(base, size, &offset))) {
+    const struct camrChunkFooter *pfooter = camrFooter(pchunk);
+    const struct camrIndexEntry *pentry = camrIndex(pchunk);
+    epicsUInt32 i;
+
+    if (camrStampCompare(&pfooter->last, pstart) < 0 ||
+        camrStampCompare(&pfooter->first, pend) > 0) continue;
+
+    for (i = 0; i < pchunk->nEntries; i++, pentry++) {
+      struct camrBlock block;
+      const char *pvalue;
+      size_t elementSize;
+      epicsUInt32 j;
+
+      if (camrStampCompare(&pentry->last, pstart) < 0 ||
+          camrStampCompare(&pentry->first, pend) > 0) continue;
+      if (strcmp(camrName(pchunk, pentry), pvName) != 0) continue;
+
+      camrBlockColumns(pchunk, pentry, &block);
+      elementSize = dbr_value_size[pentry->dbrType];
+      pvalue = block.value;
+      for (j = 0; j < pentry->nSamples; j++) {
+        epicsTimeStamp stamp;
+
+        stamp.secPastEpoch = block.secPastEpoch[j];
+        stamp.nsec = block.nsec[j];
+        if (camrStampCompare(&stamp, pstart) >= 0 &&
+            camrStampCompare(&stamp, pend) <= 0) {
+          printSample(pvName, pentry->dbrType, pentry->precision, &stamp,
+            block.status[j], block.severity[j], block.count[j], pvalue);
+        }
+        pvalue += block.count[j] * elementSize;
+      }
+    }
+  }
+}
+
+static void list(const char *base, size_t size)
+{
+  const struct camrChunkHeader *pchunk;
+  struct pvSummary_s *pvs = NULL;
+  size_t offset = 0;
+  unsigned long nPvs = 0, nChunks = 0, i;
+  char firstText[28], lastText[28];
+
+  while ((pchunk = camrNextChunk(base, size, &offset))) {
+    const struct camrIndexEntry *pentry = camrIndex(pchunk);
+    epicsUInt32 j;
+
+    nChunks++;
+    for (j = 0; j < pchunk->nEntries; j++, pentry++) {
+      struct pvSummary_s *ps;
+
+      if (pentry->pvId >= nPvs) {
+        ps = (struct pvSummary_s *)realloc(pvs,
+          (pentry->pvId + 1) * sizeof(*pvs));
+        if (!ps) {
+          fprintf(stderr, "memory allocation failed\n");
+          exit(1);
+        }
+        pvs = ps;
+        memset(pvs + nPvs, 0, (pentry->pvId + 1 - nPvs) * sizeof(*pvs));
+        nPvs = pentry->pvId + 1;
+      }
+      ps = &pvs[pentry->pvId];
+      if (!ps->name) {
+        ps->name = camrName(pchunk, pentry);
+        ps->dbrType = pentry->dbrType;
+        ps->first = pentry->first;
+      }
+      ps->last = pentry->last;
+      ps->nSamples += pentry->nSamples;
+    }
+  }
+
+  printf("%lu chunks\n", nChunks);
+  for (i = 0; i < nPvs; i++) {
+    if (!pvs[i].name) continue;
+    epicsTimeToStrftime(firstText, 28, "%m/%d/%y %H:%M:%S.%03f",
+      &pvs[i].first);
+    epicsTimeToStrftime(lastText, 28, "%m/%d/%y %H:%M:%S.%03f",
+      &pvs[i].last);
+    printf(" %-30s %-16s %10lu  %s - %s\n", pvs[i].name,
+      dbr_type_to_text(pvs[i].dbrType), pvs[i].nSamples, firstText, lastText);
+  }
+  free(pvs);
+}
+
+int main(int argc, char *argv[])
+{
+  epicsTimeStamp start, end;
+  const char *fileName = NULL;
+  int listPvs = FALSE;
+  int printHelp = FALSE;
+  int i = 1;
+  int fd;
+  struct stat st;
+  char *base;
+
+  start.secPastEpoch = 0;
+  start.nsec = 0;
+  end.secPastEpoch = 0xffffffff;
+  end.nsec = 999999999;
+
+  while (i < argc && argv[i][0] == '-') {
+    if (strcmp(argv[i], "-l") == 0) listPvs = TRUE;
+    else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      if (parseTime(argv[++i], &start)) return 1;
+    }
+    else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+      if (parseTime(argv[++i], &end)) return 1;
+    }
+    else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "-version") == 0) {
+      fprintf(stderr, "%s\n", camonitorVersion);
+      return 1;
+    }
+    else { printHelp = TRUE; break; }
+    i++;
+  }
+  if (i < argc) fileName = argv[i++];
+  if (!fileName || (!listPvs && i >= argc)) printHelp = TRUE;
+
+  if (printHelp) {
+    fprintf(stderr, "\n \tusage: %s -l file\n", argv[0]);
+    fprintf(stderr, "\tusage: %s [-s start] [-e end] file PVname ...\n\n",
+      argv[0]);
+    fprintf(stderr, "\tfile is written by \"camonitor -record dir\".\n");
+    fprintf(stderr, "\t-l lists the PVs in the file.\n");
+    fprintf(stderr, "\tstart and end are \"YYYY-MM-DD HH:MM:SS\" local time\n");
+    fprintf(stderr, "\tor seconds since 1970.\n\n");
+    return 1;
+  }
+
+  fd = open(fileName, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(fileName);
+    return 1;
+  }
+  if (st.st_size == 0) {
+    fprintf(stderr, "%s is empty\n", fileName);
+    return 1;
+  }
+  base = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == (char *)MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  close(fd);
+
+  if (camrCheckHeader(base, st.st_size)) return 1;
+
+  if (listPvs) {
+    list(base, st.st_size);
+  }
+  else {
+    for (; i < argc; i++) extract(base, st.st_size, argv[i], &start, &end);
+  }
+
+  munmap(base, st.st_size);
+  return 0;
+}
@@ -0,0 +1,504 @@
+/*************************************************************************\
+* Copyright (c) 2002 The University of Chicago, as Operator of Argonne
+* National Laboratory.
+* Copyright (c) 2002 The Regents of the University of California, as
+* Operator of Los Alamos National Laboratory.
+* This file is distributed subject to a Software License Agreement found
+* in the file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+/*
+ * $Id$
+ *
+ * Chunked record file writer and reader helpers.
+ * See camonitorRecord.h for the file layout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#include "db_access.h"
+#include "epicsTime.h"
+#include "epicsMutex.h"
+
+#include "camonitorRecord.h"
+
+/* Samples of one PV buffered for the next chunk */
+struct recStream_s {
+  char          *name;
+  int            precision;
+  int            dbrType;       /* -1 until the first event */
+  epicsUInt32    nSamples;
+  epicsUInt32    nValues;
+  epicsUInt32    sampleCap;
+  size_t         valueCap;      /* bytes */
+  epicsTimeStamp first;
+  epicsTimeStamp last;
+  epicsUInt32   *secPastEpoch;
+  epicsUInt32   *nsec;
+  epicsUInt16   *status;
+  epicsUInt16   *severity;
+  epicsUInt32   *count;
+  char          *value;
+};
+
+static FILE *recFile;
+static epicsMutexId recLock;         /* shards record from several threads */
+static struct recStream_s *recStreams;
+static int recNStreams;
+static int recStreamCap;
+static size_t recBuffered;           /* bytes waiting for the next chunk */
+static epicsTimeStamp recOldest;     /* first sample since the last flush */
+
+static size_t blockSize(const struct recStream_s *ps)
+{
+  return CAMR_ALIGN(16u * ps->nSamples +
+    (size_t)ps->nValues * dbr_value_size[ps->dbrType]);
+}
+
+int recordOpen(const char *dir)
+{
+  struct camrFileHeader header;
+  char fileName[1024];
+  char stamp[32];
+  time_t now;
+  int seq = 0;
+  int fd;
+
+  time(&now);
+  strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+  sprintf(fileName, "%.*s/camonitor-%s%s", (int)(sizeof(fileName) - 64), dir,
+    stamp, CAMR_FILE_SUFFIX);
+  /* recorders started in the same second must not overwrite each other */
+  while ((fd = open(fileName, O_WRONLY|O_CREAT|O_EXCL|O_BINARY, 0666)) < 0 &&
+         errno == EEXIST)
+    sprintf(fileName, "%.*s/camonitor-%s-%d%s", (int)(sizeof(fileName) - 64),
+      dir, stamp, ++seq, CAMR_FILE_SUFFIX);
+
+  recFile = fd < 0 ? NULL : fdopen(fd, "wb");
+  if (!recFile) {
+    fprintf(stderr, "Unable to create record file %s\n", fileName);
+    perror("open");
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CAMR_FILE_MAGIC, 4);
+  header.version = CAMR_VERSION;
+  header.byteOrder = CAMR_BYTE_ORDER;
+  header.headerSize = sizeof(header);
+  if (fwrite(&header, sizeof(header), 1, recFile) != 1) {
+    perror("Unable to write record file header");
+    fclose(recFile);
+    recFile = NULL;
+    return -1;
+  }
+  fflush(recFile);
+  recLock = epicsMutexMustCreate();
+  fprintf(stderr, "Recording to %s\n", fileName);
+  return 0;
+}
+
+static int streamAdd(const char *name, int precision)
+{
+  struct recStream_s *ps;
+
+  if (recNStreams == recStreamCap) {
+    int cap = recStreamCap ? 2 * recStreamCap : 64;
+    ps = (struct recStream_s *)realloc(recStreams, cap * sizeof(*ps));
+    if (!ps) {
+      fprintf(stderr, "memory allocation failed\n");
+      return -1;
+    }
+    recStreams = ps;
+    recStreamCap = cap;
+  }
+  ps = &recStreams[recNStreams];
+  memset(ps, 0, sizeof(*ps));
+  ps->name = (char *)malloc(strlen(name) + 1);
+  if (!ps->name) {
+    fprintf(stderr, "memory allocation failed\n");
+    return -1;
+  }
+  strcpy(ps->name, name);
+  ps->precision = precision;
+  ps->dbrType = -1;
+  return recNStreams++;
+}
+
+int recordStream(const char *name, int precision)
+{
+  int id;
+
+  if (!recFile) return -1;
+  epicsMutexMustLock(recLock);
+  id = streamAdd(name, precision);
+  epicsMutexUnlock(recLock);
+  return id;
+}
+
+static int growStream(struct recStream_s *ps, size_t valueBytes)
+{
+  if (ps->nSamples == ps->sampleCap) {
+    epicsUInt32 cap = ps->sampleCap ? 2 * ps->sampleCap : 256;
+    void *p[5];
+    int i;
+
+    p[0] = realloc(ps->secPastEpoch, cap * sizeof(epicsUInt32));
+    if (p[0]) ps->secPastEpoch = (epicsUInt32 *)p[0];
+    p[1] = realloc(ps->nsec, cap * sizeof(epicsUInt32));
+    if (p[1]) ps->nsec = (epicsUInt32 *)p[1];
+    p[2] = realloc(ps->status, cap * sizeof(epicsUInt16));
+    if (p[2]) ps->status = (epicsUInt16 *)p[2];
+    p[3] = realloc(ps->severity, cap * sizeof(epicsUInt16));
+    if (p[3]) ps->severity = (epicsUInt16 *)p[3];
+    p[4] = realloc(ps->count, cap * sizeof(epicsUInt32));
+    if (p[4]) ps->count = (epicsUInt32 *)p[4];
+    for (i = 0; i < 5; i++) {
+      if (!p[i]) return -1;
+    }
+    ps->sampleCap = cap;
+  }
+  if (ps->nValues * (size_t)dbr_value_size[ps->dbrType] + valueBytes >
+      ps->valueCap) {
+    size_t cap = ps->valueCap ? 2 * ps->valueCap : 4096;
+    char *p;
+
+    while (cap < ps->nValues * (size_t)dbr_value_size[ps->dbrType] + valueBytes)
+      cap *= 2;
+    p = (char *)realloc(ps->value, cap);
+    if (!p) return -1;
+    ps->value = p;
+    ps->valueCap = cap;
+  }
+  return 0;
+}
+
+static void recordFlush(void)
+{
+  struct camrChunkHeader header;
+  struct camrChunkFooter footer;
+  struct camrIndexEntry entry;
+  static const char pad[8] = {0};
+  size_t offset, namesSize;
+  epicsUInt32 nEntries = 0;
+  int i, first = 1;
+
+  if (!recFile || !recBuffered) return;
+
+  memset(&footer, 0, sizeof(footer));
+  offset = sizeof(header);
+  namesSize = 0;
+  for (i = 0; i < recNStreams; i++) {
+    struct recStream_s *ps = &recStreams[i];
+
+    if (!ps->nSamples) continue;
+    nEntries++;
+    offset += blockSize(ps);
+    namesSize += strlen(ps->name) + 1;
+    if (first || camrStampCompare(&ps->first, &footer.first) < 0)
+      footer.first = ps->first;
+    if (first || camrStampCompare(&ps->last, &footer.last) > 0)
+      footer.last = ps->last;
+    first = 0;
+  }
+  footer.indexOffset = offset;
+  footer.nEntries = nEntries;
+  footer.namesSize = CAMR_ALIGN(namesSize);
+  memcpy(footer.magic, CAMR_FOOTER_MAGIC, 4);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CAMR_CHUNK_MAGIC, 4);
+  header.nEntries = nEntries;
+  header.size = offset + nEntries * sizeof(entry) + footer.namesSize +
+    sizeof(footer);
+  fwrite(&header, sizeof(header), 1, recFile);
+
+  /* blocks, column by column */
+  for (i = 0; i < recNStreams; i++) {
+    struct recStream_s *ps = &recStreams[i];
+    size_t n = ps->nSamples;
+    size_t valueBytes = ps->nValues * (size_t)dbr_value_size[ps->dbrType];
+    size_t used = 16 * n + valueBytes;
+
+    if (!n) continue;
+    fwrite(ps->secPastEpoch, sizeof(epicsUInt32), n, recFile);
+    fwrite(ps->nsec, sizeof(epicsUInt32), n, recFile);
+    fwrite(ps->status, sizeof(epicsUInt16), n, recFile);
+    fwrite(ps->severity, sizeof(epicsUInt16), n, recFile);
+    fwrite(ps->count, sizeof(epicsUInt32), n, recFile);
+    fwrite(ps->value, 1, valueBytes, recFile);
+    fwrite(pad, 1, blockSize(ps) - used, recFile);
+  }
+
+  /* index */
+  offset = sizeof(header);
+  namesSize = 0;
+  for (i = 0; i < recNStreams; i++) {
+    struct recStream_s *ps = &recStreams[i];
+
+    if (!ps->nSamples) continue;
+    memset(&entry, 0, sizeof(entry));
+    entry.pvId = i;
+    entry.nameOffset = namesSize;
+    entry.dbrType = ps->dbrType;
+    entry.precision = ps->precision;
+    entry.nSamples = ps->nSamples;
+    entry.nValues = ps->nValues;
+    entry.first = ps->first;
+    entry.last = ps->last;
+    entry.offset = offset;
+    entry.size = blockSize(ps);
+    fwrite(&entry, sizeof(entry), 1, recFile);
+    offset += entry.size;
+    namesSize += strlen(ps->name) + 1;
+  }
+  for (i = 0; i < recNStreams; i++) {
+    if (recStreams[i].nSamples)
+      fwrite(recStreams[i].name, 1, strlen(recStreams[i].name) + 1, recFile);
+  }
+  fwrite(pad, 1, footer.namesSize - namesSize, recFile);
+  fwrite(&footer, sizeof(footer), 1, recFile);
+
+  if (fflush(recFile) != 0 || ferror(recFile)) {
+    perror("Unable to write record file");
+    clearerr(recFile);
+  }
+
+  for (i = 0; i < recNStreams; i++) {
+    recStreams[i].nSamples = 0;
+    recStreams[i].nValues = 0;
+  }
+  recBuffered = 0;
+}
+
+static void eventAdd(int id, long type, long count, const void *dbr)
+{
+  const struct dbr_time_string *pstamp = (const struct dbr_time_string *)dbr;
+  struct recStream_s *ps;
+  size_t valueBytes;
+
+  if (!recFile || id < 0 || id >= recNStreams) return;
+  ps = &recStreams[id];
+
+  if (ps->dbrType < 0) {
+    ps->dbrType = type;
+  }
+  else if (ps->dbrType != type) {
+    fprintf(stderr, "[%s] type changed, update not recorded\n", ps->name);
+    return;
+  }
+
+  valueBytes = (size_t)count * dbr_value_size[type];
+  if (growStream(ps, valueBytes) != 0) {
+    fprintf(stderr, "memory allocation failed, update not recorded\n");
+    return;
+  }
+
+  if (!ps->nSamples) ps->first = pstamp->stamp;
+  ps->last = pstamp->stamp;
+  ps->secPastEpoch[ps->nSamples] = pstamp->stamp.secPastEpoch;
+  ps->nsec[ps->nSamples] = pstamp->stamp.nsec;
+  ps->status[ps->nSamples] = pstamp->status;
+  ps->severity[ps->nSamples] = pstamp->severity;
+  ps->count[ps->nSamples] = count;
+  memcpy(ps->value + ps->nValues * (size_t)dbr_value_size[type],
+    dbr_value_ptr(dbr, type), valueBytes);
+  ps->nSamples++;
+  ps->nValues += count;
+
+  if (!recBuffered) epicsTimeGetCurrent(&recOldest);
+  recBuffered += 16 + valueBytes;
+  if (recBuffered >= CAMR_CHUNK_BYTES) recordFlush();
+}
+
+void recordEvent(int id, long type, long count, const void *dbr)
+{
+  if (!recFile) return;
+  epicsMutexMustLock(recLock);
+  eventAdd(id, type, count, dbr);
+  epicsMutexUnlock(recLock);
+}
+
+/*
+ * Called from the main loop so that slowly changing PVs still
+ * reach the file within CAMR_FLUSH_SECONDS.
+ */
+void recordPoll(void)
+{
+  epicsTimeStamp now;
+
+  if (!recFile) return;
+  epicsMutexMustLock(recLock);
+  epicsTimeGetCurrent(&now);
+  if (recBuffered &&
+      epicsTimeDiffInSeconds(&now, &recOldest) >= CAMR_FLUSH_SECONDS)
+    recordFlush();
+  epicsMutexUnlock(recLock);
+}
+
+/* Only after the shards have stopped */
+void recordClose(void)
+{
+  if (!recFile) return;
+  epicsMutexMustLock(recLock);
+  recordFlush();
+  fclose(recFile);
+  recFile = NULL;
+  epicsMutexUnlock(recLock);
+  epicsMutexDestroy(recLock);
+  recLock = NULL;
+}
+
+int camrStampCompare(const epicsTimeStamp *a, const epicsTimeStamp *b)
+{
+  if (a->secPastEpoch != b->secPastEpoch)
+    return a->secPastEpoch < b->secPastEpoch ? -1 : 1;
+  if (a->nsec != b->nsec)
+    return a->nsec < b->nsec ? -1 : 1;
+  return 0;
+}
+
+int camrCheckHeader(const char *base, size_t size)
+{
+  const struct camrFileHeader *pheader = (const struct camrFileHeader *)base;
+
+  if (size < sizeof(*pheader) || memcmp(pheader->magic, CAMR_FILE_MAGIC, 4)) {
+    fprintf(stderr, "Not a camonitor record file\n");
+    return -1;
+  }
+  if (pheader->byteOrder != CAMR_BYTE_ORDER) {
+    fprintf(stderr, "Record file was written with a different byte order\n");
+    return -1;
+  }
+  if (pheader->version != CAMR_VERSION) {
+    fprintf(stderr, "Unsupported record file version %u\n",
+      (unsigned)pheader->version);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Check that the index, the names and every block it points to lie
+ * inside the chunk, so that the readers can trust them.
+ */
+static int chunkValid(const struct camrChunkHeader *pchunk)
+{
+  const struct camrChunkFooter *pfooter = camrFooter(pchunk);
+  const struct camrIndexEntry *pentry;
+  const char *names;
+  size_t end = pchunk->size - sizeof(*pfooter);
+  size_t indexOffset = pfooter->indexOffset;
+  size_t namesSize = pfooter->namesSize;
+  epicsUInt32 i, j;
+
+  if (pfooter->nEntries != pchunk->nEntries ||
+      indexOffset < sizeof(*pchunk) || indexOffset > end ||
+      CAMR_ALIGN(indexOffset) != indexOffset ||
+      pchunk->nEntries > (end - indexOffset) / sizeof(*pentry) ||
+      namesSize != end - indexOffset - pchunk->nEntries * sizeof(*pentry))
+    return 0;
+
+  pentry = camrIndex(pchunk);
+  names = (const char *)(pentry + pchunk->nEntries);
+  for (i = 0; i < pchunk->nEntries; i++, pentry++) {
+    struct camrBlock block;
+    size_t n = pentry->nSamples;
+    size_t values = 0;
+
+    if (pentry->nameOffset >= namesSize ||
+        !memchr(names + pentry->nameOffset, 0,
+          namesSize - pentry->nameOffset)) return 0;
+    if (pentry->dbrType < DBR_TIME_STRING ||
+        pentry->dbrType > DBR_TIME_DOUBLE) return 0;
+    if (pentry->offset < sizeof(*pchunk) || pentry->offset > indexOffset ||
+        CAMR_ALIGN(pentry->offset) != pentry->offset ||
+        pentry->size > indexOffset - pentry->offset ||
+        n > pentry->size / 16 ||
+        pentry->nValues > (pentry->size - 16 * n) /
+          dbr_value_size[pentry->dbrType]) return 0;
+
+    /* the counts decide where each sample's values are */
+    camrBlockColumns(pchunk, pentry, &block);
+    for (j = 0; j < n; j++) {
+      if (block.count[j] > pentry->nValues - values) return 0;
+      values += block.count[j];
+    }
+    if (values != pentry->nValues) return 0;
+  }
+  return 1;
+}
+
+const struct camrChunkHeader *camrNextChunk(const char *base, size_t size,
+  size_t *pOffset)
+{
+  const struct camrChunkHeader *pchunk;
+  const struct camrChunkFooter *pfooter;
+
+  if (*pOffset < sizeof(struct camrFileHeader))
+    *pOffset = sizeof(struct camrFileHeader);
+  for (;;) {
+    if (*pOffset > size ||
+        size - *pOffset < sizeof(*pchunk) + sizeof(*pfooter)) return NULL;
+
+    pchunk = (const struct camrChunkHeader *)(base + *pOffset);
+    if (memcmp(pchunk->magic, CAMR_CHUNK_MAGIC, 4) ||
+        pchunk->size > size - *pOffset ||
+        pchunk->size < sizeof(*pchunk) + sizeof(*pfooter)) return NULL;
+    pfooter = camrFooter(pchunk);
+    if (memcmp(pfooter->magic, CAMR_FOOTER_MAGIC, 4)) return NULL;
+
+    *pOffset += pchunk->size;
+    if (chunkValid(pchunk)) return pchunk;
+    fprintf(stderr, "Skipping a chunk with a bad index\n");
+  }
+}
+
+const struct camrChunkFooter *camrFooter(const struct camrChunkHeader *pchunk)
+{
+  return (const struct camrChunkFooter *)((const char *)pchunk +
+    pchunk->size - sizeof(struct camrChunkFooter));
+}
+
+const struct camrIndexEntry *camrIndex(const struct camrChunkHeader *pchunk)
+{
+  return (const struct camrIndexEntry *)((const char *)pchunk +
+    camrFooter(pchunk)->indexOffset);
+}
+
+const char *camrName(const struct camrChunkHeader *pchunk,
+  const struct camrIndexEntry *pentry)
+{
+  return (const char *)(camrIndex(pchunk) + pchunk->nEntries) +
+    pentry->nameOffset;
+}
+
+void camrBlockColumns(const struct camrChunkHeader *pchunk,
+  const struct camrIndexEntry *pentry, struct camrBlock *pblock)
+{
+  const char *p = (const char *)pchunk + pentry->offset;
+  size_t n = pentry->nSamples;
+
+  pblock->secPastEpoch = (const epicsUInt32 *)p;
+  pblock->nsec = (const epicsUInt32 *)(p + 4 * n);
+  pblock->status = (const epicsUInt16 *)(p + 8 * n);
+  pblock->severity = (const epicsUInt16 *)(p + 10 * n);
+  pblock->count = (const epicsUInt32 *)(p + 12 * n);
+  pblock->value = p + 16 * n;
+}
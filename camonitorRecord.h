@@ -0,0 +1,136 @@
+/*************************************************************************\
+* Copyright (c) 2002 The University of Chicago, as Operator of Argonne
+* National Laboratory.
+* Copyright (c) 2002 The Regents of the University of California, as
+* Operator of Los Alamos National Laboratory.
+* This file is distributed subject to a Software License Agreement found
+* in the file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#ifndef INCcamonitorRecordh
+#define INCcamonitorRecordh
+
+/*
+ * $Id$
+ *
+ * Record file format used by "camonitor -record dir" and read back by
+ * camonitorread.
+ *
+ * A record file is a file header followed by self contained chunks which
+ * are only ever appended.  Each chunk holds one block per PV, stored
+ * column by column, and ends with an index that gives the time range and
+ * offset of every block in the chunk:
+ *
+ *   camrFileHeader
+ *   camrChunkHeader | block | block ... | camrIndexEntry[n] | names | camrChunkFooter
+ *   camrChunkHeader | ...
+ *
+ * A block with n samples and v values in total (arrays add their element
+ * count to v) is laid out as
+ *
+ *   epicsUInt32 secPastEpoch[n]
+ *   epicsUInt32 nsec[n]
+ *   epicsUInt16 status[n]
+ *   epicsUInt16 severity[n]
+ *   epicsUInt32 count[n]
+ *   value[v]                     raw DBR values, dbr_value_size[] each
+ *
+ * padded to a multiple of 8 bytes.  All offsets inside a chunk are
+ * relative to the start of its camrChunkHeader.  Numbers are stored in the
+ * byte order of the writer, which is recorded in the file header.
+ */
+
+#include <stddef.h>
+
+#include "epicsTypes.h"
+#include "epicsTime.h"
+
+#define CAMR_FILE_MAGIC     "CAMR"
+#define CAMR_CHUNK_MAGIC    "CAMK"
+#define CAMR_FOOTER_MAGIC   "CAMF"
+#define CAMR_VERSION        1
+#define CAMR_BYTE_ORDER     0x01020304
+#define CAMR_FILE_SUFFIX    ".camr"
+
+#define CAMR_CHUNK_BYTES    (1024*1024)   /* flush when this much is buffered */
+#define CAMR_FLUSH_SECONDS  5.0           /* or when data is this old        */
+
+#define CAMR_ALIGN(n)       (((n) + 7u) & ~7u)
+
+struct camrFileHeader {
+  char        magic[4];
+  epicsUInt32 version;
+  epicsUInt32 byteOrder;
+  epicsUInt32 headerSize;
+};
+
+struct camrChunkHeader {
+  char        magic[4];
+  epicsUInt32 nEntries;
+  epicsUInt32 size;            /* whole chunk including the footer */
+  epicsUInt32 reserved;
+};
+
+struct camrIndexEntry {
+  epicsUInt32    pvId;         /* same id for a PV in every chunk of a file */
+  epicsUInt32    nameOffset;   /* into the name table */
+  epicsUInt16    dbrType;      /* DBR_TIME_xxx */
+  epicsInt16     precision;
+  epicsUInt32    nSamples;
+  epicsUInt32    nValues;
+  epicsTimeStamp first;
+  epicsTimeStamp last;
+  epicsUInt32    offset;       /* of the block */
+  epicsUInt32    size;
+  epicsUInt32    reserved;
+};
+
+struct camrChunkFooter {
+  epicsTimeStamp first;        /* time range of the whole chunk */
+  epicsTimeStamp last;
+  epicsUInt32    indexOffset;
+  epicsUInt32    nEntries;
+  epicsUInt32    namesSize;
+  char           magic[4];
+};
+
+/* Column pointers of one block */
+struct camrBlock {
+  const epicsUInt32 *secPastEpoch;
+  const epicsUInt32 *nsec;
+  const epicsUInt16 *status;
+  const epicsUInt16 *severity;
+  const epicsUInt32 *count;
+  const char        *value;
+};
+
+/*
+ * Writer, used by camonitor.  recordOpen creates a new file in dir and
+ * returns 0, or -1 after printing the reason.  recordStream returns the id
+ * to pass to recordEvent for every update of the named PV.
+ */
+int  recordOpen(const char *dir);
+int  recordStream(const char *name, int precision);
+void recordEvent(int id, long type, long count, const void *dbr);
+void recordPoll(void);
+void recordClose(void);
+
+/*
+ * Reader helpers working on a file mapped or loaded into memory.
+ * camrNextChunk returns the chunk at *pOffset and advances *pOffset to the
+ * next one, or returns NULL at the end of the file or at a chunk that was
+ * only partially written.  Chunks whose index points outside the chunk, or
+ * does not describe its blocks, are skipped with a message.
+ */
+int  camrCheckHeader(const char *base, size_t size);
+const struct camrChunkHeader *camrNextChunk(const char *base, size_t size,
+  size_t *pOffset);
+const struct camrChunkFooter *camrFooter(const struct camrChunkHeader *pchunk);
+const struct camrIndexEntry *camrIndex(const struct camrChunkHeader *pchunk);
+const char *camrName(const struct camrChunkHeader *pchunk,
+  const struct camrIndexEntry *pentry);
+void camrBlockColumns(const struct camrChunkHeader *pchunk,
+  const struct camrIndexEntry *pentry, struct camrBlock *pblock);
+int  camrStampCompare(const epicsTimeStamp *a, const epicsTimeStamp *b);
+
+#endif /* INCcamonitorRecordh */
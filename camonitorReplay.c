@@ -0,0 +1,277 @@
+/*************************************************************************\
+* Copyright (c) 2002 The University of Chicago, as Operator of Argonne
+* National Laboratory.
+* Copyright (c) 2002 The Regents of the University of California, as
+* Operator of Los Alamos National Laboratory.
+* This file is distributed subject to a Software License Agreement found
+* in the file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+/*
+ * $Id$
+ *
+ * Replay of a record file written by "camonitor -record".
+ *
+ * Every recorded sample is turned back into the event_handler_args that
+ * CA would have delivered and handed to processNewEvent, so the replayed
+ * updates go through exactly the same formatting and actions as live ones.
+ * Samples of a chunk are merged across PVs in time order.  speed is the
+ * replay rate relative to the recorded timestamps, 0 replays as fast as
+ * possible.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cadef.h"
+#include "epicsTime.h"
+#include "epicsThread.h"
+
+#include "camonitor.h"
+#include "camonitorRecord.h"
+
+#define REPLAY_MIN_SLEEP   0.001        /* seconds, shorter waits are skipped */
+
+/* Position in one block of the chunk being replayed */
+struct cursor_s {
+  const struct camrIndexEntry *pentry;
+  struct camrBlock block;
+  epicsUInt32 next;                     /* sample */
+  const char *pvalue;                   /* value of sample next */
+};
+
+static struct monitor_s *monitors;      /* one per pvId */
+static epicsUInt32 nMonitors;
+
+static char *dbrBuf;
+static size_t dbrBufSize;
+
+static int cursorLess(const struct cursor_s *a, const struct cursor_s *b)
+{
+  int cmp;
+
+  if (a->block.secPastEpoch[a->next] != b->block.secPastEpoch[b->next])
+    return a->block.secPastEpoch[a->next] < b->block.secPastEpoch[b->next];
+  cmp = (a->block.nsec[a->next] > b->block.nsec[b->next]) -
+    (a->block.nsec[a->next] < b->block.nsec[b->next]);
+  if (cmp) return cmp < 0;
+  return a->pentry->pvId < b->pentry->pvId;
+}
+
+/* Restore the heap property below slot i */
+static void siftDown(struct cursor_s *heap, int n, int i)
+{
+  for (;;) {
+    int smallest = i, l = 2*i + 1, r = 2*i + 2;
+    struct cursor_s tmp;
+
+    if (l < n && cursorLess(&heap[l], &heap[smallest])) smallest = l;
+    if (r < n && cursorLess(&heap[r], &heap[smallest])) smallest = r;
+    if (smallest == i) return;
+    tmp = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = tmp;
+    i = smallest;
+  }
+}
+
+static struct monitor_s *replayMonitor(const struct camrChunkHeader *pchunk,
+  const struct camrIndexEntry *pentry)
+{
+  if (pentry->pvId >= nMonitors) {
+    struct monitor_s *p = (struct monitor_s *)realloc(monitors,
+      (pentry->pvId + 1) * sizeof(*p));
+
+    if (!p) return NULL;
+    memset(p + nMonitors, 0, (pentry->pvId + 1 - nMonitors) * sizeof(*p));
+    monitors = p;
+    nMonitors = pentry->pvId + 1;
+  }
+  if (!monitors[pentry->pvId].name[0]) {
+    strncpy(monitors[pentry->pvId].name, camrName(pchunk, pentry),
+      MAX_CHAN_NAM_LEN - 1);
+    monitors[pentry->pvId].recordId = -1;
+    monitors[pentry->pvId].storeId = -1;
+  }
+  monitors[pentry->pvId].precision = pentry->precision;
+  return &monitors[pentry->pvId];
+}
+
+/*
+ * Build the DBR_TIME_xxx buffer for the next sample of pc
+ * and deliver it.
+ */
+static void replaySample(struct cursor_s *pc, struct monitor_s *pmon)
+{
+  struct event_handler_args args;
+  struct dbr_time_string *pdbr;
+  int type = pc->pentry->dbrType;
+  long count = pc->block.count[pc->next];
+  size_t size = dbr_size_n(type, count);
+  size_t valueBytes = count * (size_t)dbr_value_size[type];
+
+  if (size > dbrBufSize) {
+    char *p = (char *)realloc(dbrBuf, size);
+
+    if (!p) {
+      fprintf(stderr, "memory allocation failed\n");
+      return;
+    }
+    dbrBuf = p;
+    dbrBufSize = size;
+  }
+  memset(dbrBuf, 0, dbr_value_offset[type]);
+  pdbr = (struct dbr_time_string *)dbrBuf;
+  pdbr->status = pc->block.status[pc->next];
+  pdbr->severity = pc->block.severity[pc->next];
+  pdbr->stamp.secPastEpoch = pc->block.secPastEpoch[pc->next];
+  pdbr->stamp.nsec = pc->block.nsec[pc->next];
+  memcpy(dbr_value_ptr(dbrBuf, type), pc->pvalue, valueBytes);
+
+  args.usr = pmon;
+  args.chid = NULL;
+  args.type = type;
+  args.count = count;
+  args.dbr = dbrBuf;
+  args.status = ECA_NORMAL;
+  processNewEvent(args);
+
+  pc->pvalue += valueBytes;
+  pc->next++;
+}
+
+int replayFile(const char *fileName, double speed)
+{
+  FILE *fp;
+  char *buf = NULL;
+  size_t bufSize = 0;
+  struct cursor_s *heap = NULL;
+  epicsUInt32 heapCap = 0;
+  epicsTimeStamp startWall, startData, now;
+  int started = FALSE;
+  unsigned long nEvents = 0;
+  double elapsed;
+
+  fp = fopen(fileName, "rb");
+  if (!fp) {
+    perror(fileName);
+    return -1;
+  }
+
+  /*
+   * Chunks are read one at a time behind a copy of the file header, so
+   * the buffer always looks like a file with a single chunk in it.
+   */
+  bufSize = sizeof(struct camrFileHeader) + CAMR_CHUNK_BYTES;
+  buf = (char *)malloc(bufSize);
+  if (!buf ||
+      fread(buf, sizeof(struct camrFileHeader), 1, fp) != 1 ||
+      camrCheckHeader(buf, sizeof(struct camrFileHeader))) {
+    fprintf(stderr, "Unable to replay %s\n", fileName);
+    free(buf);
+    fclose(fp);
+    return -1;
+  }
+
+  epicsTimeGetCurrent(&startWall);
+
+  for (;;) {
+    struct camrChunkHeader header;
+    const struct camrChunkHeader *pchunk;
+    const struct camrIndexEntry *pentry;
+    size_t offset = 0;
+    int n = 0;
+    epicsUInt32 i;
+
+    if (fread(&header, sizeof(header), 1, fp) != 1) break;
+    if (sizeof(struct camrFileHeader) + header.size > bufSize) {
+      char *p = (char *)realloc(buf, sizeof(struct camrFileHeader) +
+        header.size);
+
+      if (!p) {
+        fprintf(stderr, "memory allocation failed\n");
+        break;
+      }
+      buf = p;
+      bufSize = sizeof(struct camrFileHeader) + header.size;
+    }
+    memcpy(buf + sizeof(struct camrFileHeader), &header, sizeof(header));
+    if (header.size < sizeof(header) ||
+        fread(buf + sizeof(struct camrFileHeader) + sizeof(header),
+          header.size - sizeof(header), 1, fp) != 1) break;
+    pchunk = camrNextChunk(buf, sizeof(struct camrFileHeader) + header.size,
+      &offset);
+    if (!pchunk) {
+      if (offset == sizeof(struct camrFileHeader) + header.size)
+        continue;               /* skipped, its index was bad */
+      fprintf(stderr, "Bad chunk in %s, replay stopped\n", fileName);
+      break;
+    }
+
+    if (pchunk->nEntries > heapCap) {
+      struct cursor_s *p = (struct cursor_s *)realloc(heap,
+        pchunk->nEntries * sizeof(*heap));
+
+      if (!p) {
+        fprintf(stderr, "memory allocation failed\n");
+        break;
+      }
+      heap = p;
+      heapCap = pchunk->nEntries;
+    }
+    pentry = camrIndex(pchunk);
+    for (i = 0; i < pchunk->nEntries; i++, pentry++) {
+      if (!pentry->nSamples) continue;
+      heap[n].pentry = pentry;
+      camrBlockColumns(pchunk, pentry, &heap[n].block);
+      heap[n].next = 0;
+      heap[n].pvalue = heap[n].block.value;
+      n++;
+    }
+    for (i = n / 2; i-- > 0; ) siftDown(heap, n, i);
+
+    while (n > 0) {
+      struct cursor_s *pc = &heap[0];
+      struct monitor_s *pmon = replayMonitor(pchunk, pc->pentry);
+
+      if (!pmon) {
+        fprintf(stderr, "memory allocation failed\n");
+        n = 0;
+        break;
+      }
+
+      if (speed > 0.0) {
+        epicsTimeStamp stamp;
+        double wait;
+
+        stamp.secPastEpoch = pc->block.secPastEpoch[pc->next];
+        stamp.nsec = pc->block.nsec[pc->next];
+        if (!started) {
+          startData = stamp;
+          started = TRUE;
+        }
+        epicsTimeGetCurrent(&now);
+        wait = epicsTimeDiffInSeconds(&stamp, &startData) / speed -
+          epicsTimeDiffInSeconds(&now, &startWall);
+        if (wait >= REPLAY_MIN_SLEEP) epicsThreadSleep(wait);
+      }
+
+      replaySample(pc, pmon);
+      nEvents++;
+
+      if (pc->next == pc->pentry->nSamples) heap[0] = heap[--n];
+      siftDown(heap, n, 0);
+    }
+  }
+
+  epicsTimeGetCurrent(&now);
+  elapsed = epicsTimeDiffInSeconds(&now, &startWall);
+  fprintf(stderr, "Replayed %lu events in %.3f s, %.0f events/s\n",
+    nEvents, elapsed, elapsed > 0.0 ? nEvents / elapsed : 0.0);
+
+  free(heap);
+  free(buf);
+  fclose(fp);
+  return 0;
+}
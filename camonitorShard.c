@@ -0,0 +1,212 @@
+/*************************************************************************\
+* Copyright (c) 2002 The University of Chicago, as Operator of Argonne
+* National Laboratory.
+* Copyright (c) 2002 The Regents of the University of California, as
+* Operator of Los Alamos National Laboratory.
+* This file is distributed subject to a Software License Agreement found
+* in the file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+/*
+ * $Id$
+ *
+ * "camonitor -threads N" spreads the PVs over N shards.  Each shard is a
+ * thread with its own non preemptive CA context, so its callbacks only run
+ * while it is in ca_pend_event and it formats its own updates in its own
+ * buffers.  A PV always goes to the same shard, picked by a hash of its
+ * name, which keeps the updates of every PV in order.  START, STOP and
+ * FILTER from stdin are queued to the owning shard, CA channels can only
+ * be created and cleared from the thread attached to their context.
+ *
+ * Formatted updates are gathered into a batch per output format and handed
+ * to the sinks once the batch is full or after every ca_pend_event slice,
+ * so the sink locks are taken once per batch rather than once per update.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cadef.h"
+#include "epicsThread.h"
+#include "epicsMutex.h"
+#include "epicsEvent.h"
+#include "epicsTime.h"
+
+#include "camonitor.h"
+#include "camonitorSink.h"
+#include "camonitorFilter.h"
+
+#define SHARD_PEND_SECONDS  0.01        /* ca_pend_event slice */
+#define SHARD_BATCH_BYTES   4096        /* no larger than the smallest sink */
+#define SHARD_FORMATS       3           /* text, binary, json */
+
+struct shardCommand_s {
+  struct shardCommand_s *next;
+  int            func;          /* CAM_ADD, CAM_REMOVE or CAM_FILTER */
+  char           name[MAX_CHAN_NAM_LEN];
+  struct filter_s *filter;      /* compiled, handed over with the command */
+};
+
+struct shard_s {
+  int            index;
+  epicsMutexId   lock;          /* protects the command queue and stop */
+  struct shardCommand_s *head;
+  struct shardCommand_s *tail;
+  int            stop;
+  epicsEventId   done;
+
+  /* used only by the shard's thread */
+  struct formatter_s formatter;
+  struct line_s  batch[SHARD_FORMATS];
+  epicsTimeStamp first[SHARD_FORMATS];  /* of the first update in batch */
+};
+
+int nShards;
+static struct shard_s *shards;
+
+static int formatIndex(int format)
+{
+  return format == SINK_TEXT ? 0 : format == SINK_BINARY ? 1 : 2;
+}
+
+static int indexFormat(int i)
+{
+  return i == 0 ? SINK_TEXT : i == 1 ? SINK_BINARY : SINK_JSON;
+}
+
+static void shardFlush(struct shard_s *ps, int i)
+{
+  if (!ps->batch[i].len) return;
+  sinkOutput(indexFormat(i), ps->batch[i].text, ps->batch[i].len,
+    &ps->first[i]);
+  ps->batch[i].len = 0;
+}
+
+static void shardThread(void *arg)
+{
+  struct shard_s *ps = (struct shard_s *)arg;
+  struct shardCommand_s *pc, *next;
+  int status;
+  int stop;
+  int i;
+
+  status = ca_context_create(ca_disable_preemptive_callback);
+  SEVCHK(status, "shard ca_context_create failed\n");
+  if (status != ECA_NORMAL) {
+    fprintf(stderr, "Shard %d not started, its PVs are not monitored\n",
+      ps->index);
+    epicsEventSignal(ps->done);
+    return;
+  }
+
+  do {
+    epicsMutexMustLock(ps->lock);
+    pc = ps->head;
+    ps->head = ps->tail = NULL;
+    stop = ps->stop;
+    epicsMutexUnlock(ps->lock);
+
+    for (; pc; pc = next) {
+      next = pc->next;
+      if (pc->func == CAM_ADD) addMonitor(pc->name, ps, pc->filter);
+      else if (pc->func == CAM_FILTER) filterMonitor(pc->name, pc->filter);
+      else remMonitor(pc->name);
+      free(pc);
+    }
+
+    if (!stop) ca_pend_event(SHARD_PEND_SECONDS);
+    for (i = 0; i < SHARD_FORMATS; i++) shardFlush(ps, i);
+  } while (!stop);
+
+  ca_context_destroy();
+  epicsEventSignal(ps->done);
+}
+
+int shardStart(int n)
+{
+  int i;
+
+  shards = (struct shard_s *)calloc(n, sizeof(struct shard_s));
+  if (!shards) {
+    fprintf(stderr, "memory allocation failed\n");
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    struct shard_s *ps = &shards[i];
+
+    ps->index = i;
+    ps->lock = epicsMutexMustCreate();
+    ps->done = epicsEventMustCreate(epicsEventEmpty);
+    if (!epicsThreadCreate("camonitorShard", epicsThreadPriorityMedium,
+          epicsThreadGetStackSize(epicsThreadStackBig), shardThread, ps)) {
+      fprintf(stderr, "Unable to start shard thread\n");
+      return -1;
+    }
+    nShards++;
+  }
+  return 0;
+}
+
+/* Queue a START, STOP or FILTER to the shard owning channelName */
+void shardCommand(char *channelName, int func, struct filter_s *filter)
+{
+  struct shardCommand_s *pc;
+  struct shard_s *ps;
+  unsigned long hash = 5381;
+  const char *p;
+
+  for (p = channelName; *p; p++) hash = hash * 33 + (unsigned char)*p;
+  ps = &shards[hash % nShards];
+
+  pc = (struct shardCommand_s *)calloc(1, sizeof(*pc));
+  if (!pc) {
+    fprintf(stderr, "memory allocation failed\n");
+    filterFree(filter);
+    return;
+  }
+  pc->func = func;
+  pc->filter = filter;
+  strncpy(pc->name, channelName, MAX_CHAN_NAM_LEN-1);
+
+  epicsMutexMustLock(ps->lock);
+  if (ps->tail) ps->tail->next = pc;
+  else ps->head = pc;
+  ps->tail = pc;
+  epicsMutexUnlock(ps->lock);
+}
+
+/* Called from the shard's own CA callbacks */
+void shardOutput(struct shard_s *ps, int format, const char *data,
+  size_t len, const epicsTimeStamp *pstamp)
+{
+  int i = formatIndex(format);
+  struct line_s *pb = &ps->batch[i];
+
+  if (pb->len && pb->len + len > SHARD_BATCH_BYTES) shardFlush(ps, i);
+  if (len >= SHARD_BATCH_BYTES || lineReserve(pb, len)) {
+    sinkOutput(format, data, len, pstamp);
+    return;
+  }
+  if (!pb->len) ps->first[i] = *pstamp;
+  memcpy(pb->text + pb->len, data, len);
+  pb->len += len;
+}
+
+struct formatter_s *shardFormatter(struct shard_s *ps)
+{
+  return &ps->formatter;
+}
+
+/* Stop the shards, flushing what they have formatted, before sinkClose */
+void shardStop(void)
+{
+  int i;
+
+  for (i = 0; i < nShards; i++) {
+    epicsMutexMustLock(shards[i].lock);
+    shards[i].stop = TRUE;
+    epicsMutexUnlock(shards[i].lock);
+  }
+  for (i = 0; i < nShards; i++) epicsEventMustWait(shards[i].done);
+}
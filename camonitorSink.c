@@ -0,0 +1,470 @@
+/*************************************************************************\
+* Copyright (c) 2002 The University of Chicago, as Operator of Argonne
+* National Laboratory.
+* Copyright (c) 2002 The Regents of the University of California, as
+* Operator of Los Alamos National Laboratory.
+* This file is distributed subject to a Software License Agreement found
+* in the file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+/*
+ * $Id$
+ *
+ * Output sinks, see camonitorSink.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "cadef.h"
+#include "epicsThread.h"
+#include "epicsMutex.h"
+#include "epicsEvent.h"
+
+#include "camonitor.h"
+#include "camonitorLog.h"
+#include "camonitorSink.h"
+
+#define SINK_STDOUT         1           /* kinds */
+#define SINK_FILE           2
+#define SINK_UNIX           3
+#define SINK_LZ4            4
+
+#define SINK_BUFFER_KB      1024
+#define SINK_RETRY_SECONDS  5.0         /* between socket connect attempts */
+#define SINK_FLUSH_SECONDS  0.05        /* longest an update waits in a ring */
+#define SINK_CLOSE_SECONDS  2.0         /* longest a sink is drained at exit */
+
+struct sink_s {
+  struct sink_s *next;
+  int            kind;
+  int            format;
+  int            block;         /* wait for space instead of dropping */
+  char          *target;
+  double         rotateMB;
+  double         rotateSeconds;
+
+  epicsMutexId   lock;          /* protects the ring and the counters */
+  epicsEventId   wakeup;        /* ring filling up or stop requested */
+  epicsEventId   space;         /* data written */
+  epicsEventId   done;
+  char          *ring;
+  size_t         size;
+  size_t         head;          /* next byte written by sinkOutput */
+  size_t         tail;          /* next byte written out */
+  size_t         end;           /* of the data before head, 0 unless the
+                                 * ring has wrapped */
+  size_t         used;          /* bytes between tail and head */
+  int            stop;
+  unsigned long  dropped;
+
+  FILE          *fp;            /* stdout and file */
+  int            broken;        /* stdout reader went away */
+  int            fd;            /* unix */
+  epicsTimeStamp lastConnect;
+};
+
+int sinkFormats;
+volatile sig_atomic_t sinkStopping;
+static struct sink_s *sinks;
+
+int sinkAdd(const char *spec)
+{
+  struct sink_s *ps;
+  const char *opt;
+  char *p;
+  size_t len;
+
+  ps = (struct sink_s *)calloc(1, sizeof(struct sink_s));
+  if (!ps) {
+    fprintf(stderr, "memory allocation failed\n");
+    return -1;
+  }
+  ps->format = SINK_TEXT;
+  ps->size = SINK_BUFFER_KB * 1024;
+  ps->fd = -1;
+
+  len = strcspn(spec, ":,");
+  if (len == 6 && strncmp(spec, "stdout", 6) == 0) ps->kind = SINK_STDOUT;
+  else if (len == 4 && strncmp(spec, "file", 4) == 0) ps->kind = SINK_FILE;
+  else if (len == 4 && strncmp(spec, "unix", 4) == 0) ps->kind = SINK_UNIX;
+  else if (len == 3 && strncmp(spec, "lz4", 3) == 0) ps->kind = SINK_LZ4;
+  else {
+    fprintf(stderr, "Unknown sink \"%s\"\n", spec);
+    free(ps);
+    return -1;
+  }
+  spec += len;
+
+  if (*spec == ':') {
+    spec++;
+    len = strcspn(spec, ",");
+    ps->target = (char *)malloc(len + 1);
+    if (!ps->target) {
+      fprintf(stderr, "memory allocation failed\n");
+      free(ps);
+      return -1;
+    }
+    memcpy(ps->target, spec, len);
+    ps->target[len] = 0;
+    spec += len;
+  }
+  if (ps->kind != SINK_STDOUT && (!ps->target || !ps->target[0])) {
+    fprintf(stderr, "Sink needs a target, for example file:path\n");
+    free(ps);
+    return -1;
+  }
+
+  for (opt = spec; *opt == ','; ) {
+    opt++;
+    len = strcspn(opt, ",");
+    if (strncmp(opt, "format=text", len) == 0 && len == 11)
+      ps->format = SINK_TEXT;
+    else if (strncmp(opt, "format=binary", len) == 0 && len == 13)
+      ps->format = SINK_BINARY;
+    else if (strncmp(opt, "format=json", len) == 0 && len == 11)
+      ps->format = SINK_JSON;
+    else if (strncmp(opt, "buffer=", 7) == 0 && len > 7)
+      ps->size = (size_t)strtoul(opt + 7, &p, 10) * 1024;
+    else if (strncmp(opt, "drop", len) == 0 && len == 4)
+      ps->block = FALSE;
+    else if (strncmp(opt, "block", len) == 0 && len == 5)
+      ps->block = TRUE;
+    else if (strncmp(opt, "rotate-size=", 12) == 0 && len > 12)
+      ps->rotateMB = atof(opt + 12);
+    else if (strncmp(opt, "rotate-time=", 12) == 0 && len > 12)
+      ps->rotateSeconds = atof(opt + 12);
+    else {
+      fprintf(stderr, "Unknown sink option \"%.*s\"\n", (int)len, opt);
+      free(ps->target);
+      free(ps);
+      return -1;
+    }
+    opt += len;
+  }
+  if (ps->size < 4096) ps->size = 4096;
+  if (ps->kind == SINK_LZ4 && ps->format == SINK_BINARY) {
+    fprintf(stderr, "lz4 sinks only take text or json\n");
+    free(ps->target);
+    free(ps);
+    return -1;
+  }
+  if (ps->kind == SINK_LZ4) {
+    struct sink_s *other;
+
+    /* camonitorLog.c keeps a single log */
+    for (other = sinks; other; other = other->next)
+      if (other->kind == SINK_LZ4) {
+        fprintf(stderr, "Only one lz4 sink or -log is allowed\n");
+        free(ps->target);
+        free(ps);
+        return -1;
+      }
+  }
+
+  ps->next = sinks;
+  sinks = ps;
+  return 0;
+}
+
+#ifndef _WIN32
+static void unixConnect(struct sink_s *ps)
+{
+  struct sockaddr_un addr;
+  epicsTimeStamp now;
+
+  epicsTimeGetCurrent(&now);
+  if (ps->lastConnect.secPastEpoch &&
+      epicsTimeDiffInSeconds(&now, &ps->lastConnect) < SINK_RETRY_SECONDS)
+    return;
+  ps->lastConnect = now;
+
+  ps->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (ps->fd < 0) return;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, ps->target, sizeof(addr.sun_path) - 1);
+  if (connect(ps->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (DEBUG) fprintf(stderr, "sink unix:%s not connected\n", ps->target);
+    close(ps->fd);
+    ps->fd = -1;
+  }
+}
+#endif
+
+/* Write out everything or give up on this piece, never retry forever */
+/*
+ * SIGPIPE is ignored once there is a unix sink or -serve, so a broken
+ * stdout shows up here instead.  Stop camonitor then, as SIGPIPE would.
+ */
+static void sinkWriteError(struct sink_s *ps)
+{
+#ifdef EPIPE
+  if (ps->kind == SINK_STDOUT && errno == EPIPE && !ps->broken) {
+    ps->broken = TRUE;
+    raise(SIGTERM);
+  }
+#endif
+  clearerr(ps->fp);
+}
+
+static void sinkFlush(struct sink_s *ps)
+{
+  if (ps->fp && !ps->broken && fflush(ps->fp) == EOF) sinkWriteError(ps);
+}
+
+static void sinkWriteOut(struct sink_s *ps, const char *data, size_t len)
+{
+  switch (ps->kind) {
+  case SINK_STDOUT:
+  case SINK_FILE:
+    if (ps->broken) break;
+    if (fwrite(data, 1, len, ps->fp) != len) sinkWriteError(ps);
+    break;
+#ifndef _WIN32
+  case SINK_UNIX:
+    if (ps->fd < 0) unixConnect(ps);
+    while (ps->fd >= 0 && len) {
+      ssize_t n = write(ps->fd, data, len);
+
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        close(ps->fd);
+        ps->fd = -1;
+        break;
+      }
+      data += n;
+      len -= n;
+    }
+    break;
+#endif
+  }
+}
+
+static void sinkThread(void *arg)
+{
+  struct sink_s *ps = (struct sink_s *)arg;
+
+  epicsMutexMustLock(ps->lock);
+  for (;;) {
+    size_t tail, n;
+
+    if (!ps->used) {
+      if (ps->stop) break;
+      sinkFlush(ps);
+      epicsMutexUnlock(ps->lock);
+      epicsEventWaitWithTimeout(ps->wakeup, SINK_FLUSH_SECONDS);
+      epicsMutexMustLock(ps->lock);
+      continue;
+    }
+
+    /* oldest contiguous piece of the ring, whole records only */
+    tail = ps->tail;
+    n = (ps->end ? ps->end : ps->head) - tail;
+    epicsMutexUnlock(ps->lock);
+
+    sinkWriteOut(ps, ps->ring + tail, n);
+
+    epicsMutexMustLock(ps->lock);
+    ps->tail += n;
+    if (ps->end && ps->tail == ps->end) ps->tail = ps->end = 0;
+    ps->used -= n;
+    if (ps->block) epicsEventSignal(ps->space);
+  }
+  epicsMutexUnlock(ps->lock);
+
+  sinkFlush(ps);
+  epicsEventSignal(ps->done);
+}
+
+int sinkStart(void)
+{
+  struct sink_s *ps;
+
+  if (!sinks) {
+    if (sinkAdd("stdout,block")) return -1;
+  }
+
+  for (ps = sinks; ps; ps = ps->next) {
+    sinkFormats |= ps->format;
+
+    switch (ps->kind) {
+    case SINK_LZ4:
+      if (logOpen(ps->target, ps->rotateMB * 1e6, ps->rotateSeconds))
+        return -1;
+      continue;                 /* has its own thread and buffers */
+    case SINK_STDOUT:
+      ps->fp = stdout;
+      break;
+    case SINK_FILE:
+      ps->fp = fopen(ps->target, ps->format == SINK_BINARY ? "ab" : "a");
+      if (!ps->fp) {
+        fprintf(stderr, "Unable to open sink file %s\n", ps->target);
+        perror("fopen");
+        return -1;
+      }
+      break;
+    case SINK_UNIX:
+#ifdef _WIN32
+      fprintf(stderr, "unix sinks are not available on this system\n");
+      return -1;
+#else
+#ifdef SIGPIPE
+      signal(SIGPIPE, SIG_IGN);     /* a reader going away is not fatal */
+#endif
+      unixConnect(ps);
+      break;
+#endif
+    }
+
+    ps->ring = (char *)malloc(ps->size);
+    if (!ps->ring) {
+      fprintf(stderr, "memory allocation failed\n");
+      return -1;
+    }
+    ps->lock = epicsMutexMustCreate();
+    ps->wakeup = epicsEventMustCreate(epicsEventEmpty);
+    ps->space = epicsEventMustCreate(epicsEventEmpty);
+    ps->done = epicsEventMustCreate(epicsEventEmpty);
+    if (!epicsThreadCreate("camonitorSink", epicsThreadPriorityLow,
+          epicsThreadGetStackSize(epicsThreadStackSmall), sinkThread, ps)) {
+      fprintf(stderr, "Unable to start sink thread\n");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Make room for len contiguous bytes at head, wrapping to the start of
+ * the ring rather than splitting them.  ps->lock held.
+ */
+static int sinkRoom(struct sink_s *ps, size_t len)
+{
+  if (!ps->used) ps->head = ps->tail = ps->end = 0;
+  if (ps->end) return ps->tail - ps->head >= len;
+  if (ps->size - ps->head >= len) return TRUE;
+  if (ps->tail < len) return FALSE;
+  ps->end = ps->head;
+  ps->head = 0;
+  return TRUE;
+}
+
+/*
+ * A record is never split in the ring, so it reaches the output in a
+ * single write and nothing can land in the middle of it.
+ */
+static void sinkPut(struct sink_s *ps, const char *data, size_t len)
+{
+  int wake;
+
+  epicsMutexMustLock(ps->lock);
+  while (!sinkRoom(ps, len)) {
+    if (!ps->block || len > ps->size ||
+        sinkStopping) {         /* a stalled reader must not hold up exit */
+      ps->dropped++;
+      epicsMutexUnlock(ps->lock);
+      return;
+    }
+    epicsMutexUnlock(ps->lock);
+    epicsEventWaitWithTimeout(ps->space, SINK_FLUSH_SECONDS);
+    epicsMutexMustLock(ps->lock);
+  }
+
+  memcpy(ps->ring + ps->head, data, len);
+  ps->head += len;
+  /*
+   * The writer polls every SINK_FLUSH_SECONDS, so it is only woken early
+   * when the ring passes an eighth full.  Waking it for every update
+   * costs more than formatting the update.
+   */
+  wake = ps->used < ps->size / 8 && ps->used + len >= ps->size / 8;
+  ps->used += len;
+  epicsMutexUnlock(ps->lock);
+  if (wake) epicsEventSignal(ps->wakeup);
+}
+
+void sinkOutput(int format, const char *data, size_t len,
+  const epicsTimeStamp *pstamp)
+{
+  struct sink_s *ps;
+
+  for (ps = sinks; ps; ps = ps->next) {
+    if (ps->format != format) continue;
+    if (ps->kind == SINK_LZ4) logWrite(data, len, pstamp);
+    else sinkPut(ps, data, len);
+  }
+}
+
+/*
+ * Drain and stop all sinks, giving each SINK_CLOSE_SECONDS.  Returns -1
+ * when a sink could not be drained in time, its thread is left blocked.
+ */
+int sinkClose(void)
+{
+  struct sink_s *ps;
+  int status = 0;
+
+  sinkStopping = TRUE;
+  for (ps = sinks; ps; ps = ps->next) {
+    if (ps->kind == SINK_LZ4) {
+      logClose();
+      continue;
+    }
+    if (!ps->lock) continue;
+    epicsMutexMustLock(ps->lock);
+    ps->stop = TRUE;
+    epicsMutexUnlock(ps->lock);
+    epicsEventSignal(ps->wakeup);
+    if (epicsEventWaitWithTimeout(ps->done, SINK_CLOSE_SECONDS) !=
+        epicsEventWaitOK) {
+      fprintf(stderr, "Sink %s%s%s not drained, output lost\n",
+        ps->kind == SINK_STDOUT ? "stdout" :
+        ps->kind == SINK_FILE ? "file" : "unix",
+        ps->target ? ":" : "", ps->target ? ps->target : "");
+      status = -1;
+      continue;
+    }
+    if (ps->dropped)
+      fprintf(stderr, "%lu updates dropped by sink %s%s%s\n", ps->dropped,
+        ps->kind == SINK_STDOUT ? "stdout" :
+        ps->kind == SINK_FILE ? "file" : "unix",
+        ps->target ? ":" : "", ps->target ? ps->target : "");
+    if (ps->kind == SINK_FILE) fclose(ps->fp);
+  }
+  return status;
+}
+
+void sinkFormatBinary(struct line_s *pline, const struct monitor_s *pmon,
+  const struct event_handler_args *pargs)
+{
+  struct sinkBinary_s header;
+  size_t nameLen = strlen(pmon->name);
+  size_t dbrSize = dbr_size_n(pargs->type, pargs->count);
+
+  memset(&header, 0, sizeof(header));
+  header.magic = SINK_BINARY_MAGIC;
+  header.dbrType = (epicsUInt16)pargs->type;
+  header.nameSize = (epicsUInt16)((nameLen + 8) & ~7u);
+  header.precision = pmon->precision;
+  header.count = (epicsUInt32)pargs->count;
+  header.size = (epicsUInt32)(sizeof(header) + header.nameSize + dbrSize);
+
+  pline->len = 0;
+  if (lineReserve(pline, header.size)) return;
+  memcpy(pline->text, &header, sizeof(header));
+  memset(pline->text + sizeof(header), 0, header.nameSize);
+  memcpy(pline->text + sizeof(header), pmon->name, nameLen);
+  memcpy(pline->text + sizeof(header) + header.nameSize, pargs->dbr, dbrSize);
+  pline->len = header.size;
+}
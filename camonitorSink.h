@@ -0,0 +1,93 @@
+/*************************************************************************\
+* Copyright (c) 2002 The University of Chicago, as Operator of Argonne
+* National Laboratory.
+* Copyright (c) 2002 The Regents of the University of California, as
+* Operator of Los Alamos National Laboratory.
+* This file is distributed subject to a Software License Agreement found
+* in the file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#ifndef INCcamonitorSinkh
+#define INCcamonitorSinkh
+
+/*
+ * $Id$
+ *
+ * Output sinks.  processNewEvent formats an update once for every format
+ * some sink uses and hands the result to sinkOutput, which copies it into
+ * the ring buffer of each sink with that format.  Every sink has its own
+ * writer thread, so a slow consumer only fills its own buffer.  When a
+ * buffer is full the update is dropped for that sink ("drop", the default)
+ * or the caller waits for space ("block", which stalls all sinks).
+ *
+ * A sink is given on the command line as
+ *
+ *   kind[:target][,option...]
+ *
+ *   stdout                  standard output
+ *   file:path               appended to path
+ *   unix:path               sent to a Unix domain stream socket listening
+ *                           at path, reconnected when the reader goes away
+ *   lz4:base                compressed rotating log, see camonitorLog.h,
+ *                           at most one, -log base is one too
+ *
+ *   format=text|binary|json default text, json is NDJSON, see camonitorJson.c
+ *   buffer=KB               ring buffer size, default 1024
+ *   drop | block            full buffer policy
+ *   rotate-size=MB          lz4 only
+ *   rotate-time=s           lz4 only
+ *
+ * Without any sink camonitor writes text to stdout, blocking when stdout
+ * does, as it always has.
+ *
+ * The binary format is a stream of records, in the byte order of the
+ * writer, each made of a sinkBinary_s header, the PV name padded with
+ * zeros to a multiple of 8 bytes and the DBR_TIME_xxx buffer exactly as
+ * delivered by CA, dbr_size_n(dbrType, count) bytes.
+ */
+
+#include <stddef.h>
+#include <signal.h>
+
+#include "cadef.h"
+#include "epicsTypes.h"
+#include "epicsTime.h"
+
+#include "camonitor.h"
+
+#define SINK_TEXT           1           /* formats, bit mask */
+#define SINK_BINARY         2
+#define SINK_JSON           4
+
+#define SINK_BINARY_MAGIC   0x43414d42  /* "CAMB" */
+
+struct sinkBinary_s {
+  epicsUInt32 magic;
+  epicsUInt32 size;             /* whole record */
+  epicsUInt16 dbrType;
+  epicsUInt16 nameSize;         /* padded */
+  epicsInt16  precision;
+  epicsUInt16 reserved;
+  epicsUInt32 count;
+  epicsUInt32 reserved2;
+};
+
+extern int sinkFormats;         /* formats used by at least one sink */
+extern volatile sig_atomic_t sinkStopping;  /* drop instead of blocking */
+
+int  sinkAdd(const char *spec);
+int  sinkStart(void);
+void sinkOutput(int format, const char *data, size_t len,
+  const epicsTimeStamp *pstamp);
+int  sinkClose(void);
+
+void sinkFormatBinary(struct line_s *pline, const struct monitor_s *pmon,
+  const struct event_handler_args *pargs);
+
+/* camonitorJson.c */
+void sinkFormatJson(struct line_s *pline, const struct monitor_s *pmon,
+  const struct event_handler_args *pargs);
+void sinkFormatJsonError(struct line_s *pline, const char *name,
+  const char *error);
+
+#endif /* INCcamonitorSinkh */
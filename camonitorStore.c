@@ -0,0 +1,706 @@
+/*************************************************************************\
+* Copyright (c) 2002 The University of Chicago, as Operator of Argonne
+* National Laboratory.
+* Copyright (c) 2002 The Regents of the University of California, as
+* Operator of Los Alamos National Laboratory.
+* This file is distributed subject to a Software License Agreement found
+* in the file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+/*
+ * $Id$
+ *
+ * Latest value store and its socket server, see camonitorStore.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "cadef.h"
+#include "epicsTypes.h"
+#include "epicsThread.h"
+#include "epicsMutex.h"
+#include "epicsEvent.h"
+
+#include "camonitor.h"
+#include "camonitorSink.h"
+#include "camonitorStore.h"
+
+#define STORE_INLINE        64          /* values this small live in the entry */
+#define STORE_MAX_CLIENTS   64
+#define STORE_LINE_MAX      16384       /* longest request line */
+#define STORE_BACKLOG       (1024*1024) /* subscriptions wait above this */
+#define STORE_BACKLOG_MAX   (16*1024*1024)  /* client is not reading */
+#define STORE_POLL_MS       100
+
+#ifndef _WIN32
+
+struct storeEntry_s {
+  epicsUInt32    seq;           /* bumped by every update */
+  epicsInt16     dbrType;       /* -1 before the first update */
+  epicsInt16     precision;
+  epicsUInt16    stale;         /* STORE_DISCONNECTED or STORE_STOPPED */
+  epicsUInt32    count;
+  epicsUInt32    size;          /* of the DBR_TIME_xxx buffer */
+  epicsUInt32    cap;           /* of heap, 0 while the value is inline */
+  int            subscribers;
+  char          *name;
+  char          *heap;
+  union {
+    double       align;
+    char         data[STORE_INLINE];
+  } local;
+};
+
+#define entryData(PE) ((PE)->cap ? (PE)->heap : (PE)->local.data)
+
+/* shared between storeUpdate and the server thread, protected by storeLock */
+static epicsMutexId storeLock;
+static struct storeEntry_s *entries;
+static int nEntries;
+static int capEntries;
+static int *hashIds;                /* entry id + 1, 0 for an empty slot */
+static unsigned hashSize;           /* power of 2, at most half full */
+static int wakePending;
+static int storeStop;
+
+struct client_s {
+  int            fd;
+  int            format;        /* SINK_TEXT, SINK_BINARY or SINK_JSON */
+  char          *in;
+  size_t         inLen;
+  struct line_s  out;
+  size_t         sent;          /* bytes of out already written */
+  int           *subId;
+  epicsUInt32   *subSeq;        /* entry seq when last sent */
+  int            nSub;
+  int            capSub;
+};
+
+static int wakeFd[2] = {-1, -1};    /* storeUpdate to the server thread */
+static epicsEventId storeDone;
+
+/* owned by the server thread */
+static int listenFd = -1;
+static char *storePath;
+static struct client_s clients[STORE_MAX_CLIENTS];
+static int nClients;
+static struct formatter_s storeFormatter;
+static struct line_s scratch;       /* copy of the value being formatted */
+
+static unsigned nameHash(const char *name)
+{
+  unsigned hash = 5381;
+
+  while (*name) hash = hash * 33 + (unsigned char)*name++;
+  return hash;
+}
+
+static int storeRehash(void)
+{
+  unsigned size = hashSize ? 2 * hashSize : 1024;
+  int *ids = (int *)calloc(size, sizeof(int));
+  int id;
+
+  if (!ids) return -1;
+  for (id = 0; id < nEntries; id++) {
+    unsigned i = nameHash(entries[id].name) & (size - 1);
+
+    while (ids[i]) i = (i + 1) & (size - 1);
+    ids[i] = id + 1;
+  }
+  free(hashIds);
+  hashIds = ids;
+  hashSize = size;
+  return 0;
+}
+
+/* Entry id of name, -1 if unknown and not created.  storeLock held. */
+static int storeFind(const char *name, int create)
+{
+  struct storeEntry_s *pe;
+  unsigned i;
+
+  if (hashSize) {
+    for (i = nameHash(name) & (hashSize - 1); hashIds[i];
+         i = (i + 1) & (hashSize - 1)) {
+      if (strcmp(entries[hashIds[i] - 1].name, name) == 0)
+        return hashIds[i] - 1;
+    }
+  }
+  if (!create) return -1;
+
+  if (nEntries == capEntries) {
+    int cap = capEntries ? 2 * capEntries : 256;
+
+    pe = (struct storeEntry_s *)realloc(entries, cap * sizeof(*pe));
+    if (!pe) return -1;
+    entries = pe;
+    capEntries = cap;
+  }
+  pe = &entries[nEntries];
+  memset(pe, 0, sizeof(*pe));
+  pe->dbrType = -1;
+  pe->name = (char *)malloc(strlen(name) + 1);
+  if (!pe->name) return -1;
+  strcpy(pe->name, name);
+
+  if (2 * (unsigned)(nEntries + 1) > hashSize) {
+    nEntries++;             /* rehash includes the new entry */
+    if (storeRehash()) {
+      free(pe->name);
+      nEntries--;
+      return -1;
+    }
+    return nEntries - 1;
+  }
+  for (i = nameHash(name) & (hashSize - 1); hashIds[i];
+       i = (i + 1) & (hashSize - 1)) ;
+  hashIds[i] = nEntries + 1;
+  return nEntries++;
+}
+
+#endif /* _WIN32 */
+
+void storeUpdate(struct monitor_s *pmon, const struct event_handler_args *pargs)
+{
+#ifndef _WIN32
+  struct storeEntry_s *pe;
+  size_t size = dbr_size_n(pargs->type, pargs->count);
+  int wake = FALSE;
+
+  epicsMutexMustLock(storeLock);
+  if (pmon->storeId < 0) pmon->storeId = storeFind(pmon->name, TRUE);
+  if (pmon->storeId < 0) {
+    epicsMutexUnlock(storeLock);
+    return;
+  }
+  pe = &entries[pmon->storeId];
+  if (size > STORE_INLINE && size > pe->cap) {
+    char *heap = (char *)realloc(pe->heap, size);
+
+    if (!heap) {
+      epicsMutexUnlock(storeLock);
+      return;
+    }
+    pe->heap = heap;
+    pe->cap = (epicsUInt32)size;
+  }
+  memcpy(entryData(pe), pargs->dbr, size);
+  pe->dbrType = (epicsInt16)pargs->type;
+  pe->precision = pmon->precision;
+  pe->count = (epicsUInt32)pargs->count;
+  pe->size = (epicsUInt32)size;
+  pe->stale = 0;
+  pe->seq++;
+  if (pe->subscribers && !wakePending) wake = wakePending = TRUE;
+  epicsMutexUnlock(storeLock);
+
+  if (wake && write(wakeFd[1], "", 1) < 0) {
+    /* pipe full, the server is awake anyway */
+  }
+#endif
+}
+
+/*
+ * Mark the value of pmon as no longer current, why is STORE_DISCONNECTED
+ * or STORE_STOPPED.  The next update makes it current again.
+ */
+void storeStale(struct monitor_s *pmon, int why)
+{
+#ifndef _WIN32
+  struct storeEntry_s *pe;
+  int wake = FALSE;
+
+  epicsMutexMustLock(storeLock);
+  if (pmon->storeId < 0) pmon->storeId = storeFind(pmon->name, FALSE);
+  if (pmon->storeId < 0) {
+    epicsMutexUnlock(storeLock);
+    return;
+  }
+  pe = &entries[pmon->storeId];
+  if (pe->dbrType >= 0 && pe->stale != why) {
+    pe->stale = (epicsUInt16)why;
+    pe->seq++;
+    if (pe->subscribers && !wakePending) wake = wakePending = TRUE;
+  }
+  epicsMutexUnlock(storeLock);
+
+  if (wake && write(wakeFd[1], "", 1) < 0) {
+    /* pipe full, the server is awake anyway */
+  }
+#endif
+}
+
+#ifndef _WIN32
+
+static void clientAppend(struct client_s *pc, const char *data, size_t len)
+{
+  if (lineReserve(&pc->out, len)) return;
+  memcpy(pc->out.text + pc->out.len, data, len);
+  pc->out.len += len;
+}
+
+/* Report name as having no current value, why is a STORE_xxx dbrType */
+static void clientNoValue(struct client_s *pc, const char *name, int why)
+{
+  struct sinkBinary_s header;
+  struct line_s *pline = &storeFormatter.text;
+  size_t nameLen = strlen(name);
+  const char *error = why == STORE_DISCONNECTED ? "disconnected" :
+    why == STORE_STOPPED ? "not monitored" : "no value";
+
+  switch (pc->format) {
+  case SINK_BINARY:
+    memset(&header, 0, sizeof(header));
+    header.magic = SINK_BINARY_MAGIC;
+    header.dbrType = (epicsUInt16)why;
+    header.nameSize = (epicsUInt16)((nameLen + 8) & ~7u);
+    header.size = (epicsUInt32)(sizeof(header) + header.nameSize);
+    pline = &storeFormatter.binary;
+    pline->len = 0;
+    if (lineReserve(pline, header.size)) return;
+    memcpy(pline->text, &header, sizeof(header));
+    memset(pline->text + sizeof(header), 0, header.nameSize);
+    memcpy(pline->text + sizeof(header), name, nameLen);
+    pline->len = header.size;
+    break;
+  case SINK_JSON:
+    pline = &storeFormatter.json;
+    sinkFormatJsonError(pline, name, error);
+    break;
+  default:
+    pline->len = 0;
+    if (lineReserve(pline, nameLen + 64)) return;
+    pline->len = sprintf(pline->text, " %-30s %s\n", name, error);
+    break;
+  }
+  clientAppend(pc, pline->text, pline->len);
+}
+
+/*
+ * Format the value of entry id, or report name as having none, and
+ * remember the seq sent.  The value is copied out so that formatting
+ * does not hold up storeUpdate.
+ */
+static void clientValue(struct client_s *pc, int id, const char *name,
+  epicsUInt32 *pseq)
+{
+  struct monitor_s mon;
+  struct event_handler_args args;
+  struct line_s *pline;
+  int type = -1;
+  int why = STORE_NO_VALUE;
+
+  memset(&mon, 0, sizeof(mon));
+  memset(&args, 0, sizeof(args));
+  strncpy(mon.name, name, MAX_CHAN_NAM_LEN-1);
+  if (id >= 0) {
+    struct storeEntry_s *pe;
+
+    epicsMutexMustLock(storeLock);
+    pe = &entries[id];
+    strncpy(mon.name, pe->name, MAX_CHAN_NAM_LEN-1);
+    if (pe->stale) why = pe->stale;
+    else if (pe->dbrType >= 0 && !lineReserve(&scratch, pe->size)) {
+      memcpy(scratch.text, entryData(pe), pe->size);
+      type = pe->dbrType;
+      args.count = pe->count;
+      mon.precision = pe->precision;
+    }
+    if (pseq) *pseq = pe->seq;
+    epicsMutexUnlock(storeLock);
+  }
+  if (type < 0) {
+    clientNoValue(pc, mon.name, why);
+    return;
+  }
+
+  args.usr = &mon;
+  args.type = type;
+  args.dbr = scratch.text;
+  args.status = ECA_NORMAL;
+  switch (pc->format) {
+  case SINK_BINARY:
+    pline = &storeFormatter.binary;
+    sinkFormatBinary(pline, &mon, &args);
+    break;
+  case SINK_JSON:
+    pline = &storeFormatter.json;
+    sinkFormatJson(pline, &mon, &args);
+    break;
+  default:
+    pline = &storeFormatter.text;
+    formatText(pline, &mon, &args);
+    break;
+  }
+  clientAppend(pc, pline->text, pline->len);
+}
+
+static int clientSubscribed(struct client_s *pc, int id)
+{
+  int i;
+
+  for (i = 0; i < pc->nSub; i++)
+    if (pc->subId[i] == id) return i;
+  return -1;
+}
+
+static void clientSubscribe(struct client_s *pc, const char *name)
+{
+  int id;
+
+  epicsMutexMustLock(storeLock);
+  id = storeFind(name, TRUE);
+  if (id < 0 || clientSubscribed(pc, id) >= 0) {
+    epicsMutexUnlock(storeLock);
+    return;
+  }
+  if (pc->nSub == pc->capSub) {
+    int cap = pc->capSub ? 2 * pc->capSub : 16;
+    int *subId = (int *)realloc(pc->subId, cap * sizeof(int));
+    epicsUInt32 *subSeq;
+
+    if (subId) pc->subId = subId;
+    subSeq = (epicsUInt32 *)realloc(pc->subSeq, cap * sizeof(epicsUInt32));
+    if (subSeq) pc->subSeq = subSeq;
+    if (!subId || !subSeq) {
+      epicsMutexUnlock(storeLock);
+      fprintf(stderr, "memory allocation failed\n");
+      return;
+    }
+    pc->capSub = cap;
+  }
+  entries[id].subscribers++;
+  pc->subId[pc->nSub] = id;
+  epicsMutexUnlock(storeLock);
+
+  clientValue(pc, id, name, &pc->subSeq[pc->nSub]);
+  pc->nSub++;
+}
+
+static void clientUnsubscribe(struct client_s *pc, int i)
+{
+  epicsMutexMustLock(storeLock);
+  entries[pc->subId[i]].subscribers--;
+  epicsMutexUnlock(storeLock);
+  pc->nSub--;
+  pc->subId[i] = pc->subId[pc->nSub];
+  pc->subSeq[i] = pc->subSeq[pc->nSub];
+}
+
+static char *nextWord(char **pp)
+{
+  char *p = *pp, *word;
+
+  while (*p == ' ' || *p == '\t' || *p == '\r') p++;
+  if (!*p) return NULL;
+  word = p;
+  while (*p && *p != ' ' && *p != '\t' && *p != '\r') p++;
+  if (*p) *p++ = 0;
+  *pp = p;
+  return word;
+}
+
+/* Returns -1 to close the connection */
+static int clientRequest(struct client_s *pc, char *line)
+{
+  char *request = nextWord(&line);
+  char *name;
+  int id, i;
+
+  if (!request) return 0;
+  if (DEBUG) fprintf(stderr, "store request %s%s\n", request, line);
+
+  if (strcmp(request, "GET") == 0) {
+    while ((name = nextWord(&line)) != NULL) {
+      epicsMutexMustLock(storeLock);
+      id = storeFind(name, FALSE);
+      epicsMutexUnlock(storeLock);
+      clientValue(pc, id, name, NULL);
+    }
+  }
+  else if (strcmp(request, "SUBSCRIBE") == 0) {
+    while ((name = nextWord(&line)) != NULL) clientSubscribe(pc, name);
+  }
+  else if (strcmp(request, "UNSUBSCRIBE") == 0) {
+    while ((name = nextWord(&line)) != NULL) {
+      epicsMutexMustLock(storeLock);
+      id = storeFind(name, FALSE);
+      epicsMutexUnlock(storeLock);
+      if (id >= 0 && (i = clientSubscribed(pc, id)) >= 0)
+        clientUnsubscribe(pc, i);
+    }
+  }
+  else if (strcmp(request, "FORMAT") == 0) {
+    name = nextWord(&line);
+    if (!name) return -1;
+    if (strcmp(name, "text") == 0) pc->format = SINK_TEXT;
+    else if (strcmp(name, "binary") == 0) pc->format = SINK_BINARY;
+    else if (strcmp(name, "json") == 0) pc->format = SINK_JSON;
+    else return -1;
+  }
+  else {
+    return -1;
+  }
+  return 0;
+}
+
+/* Returns -1 to close the connection */
+static int clientRead(struct client_s *pc)
+{
+  ssize_t n;
+  char *start, *end;
+
+  n = read(pc->fd, pc->in + pc->inLen, STORE_LINE_MAX - pc->inLen);
+  if (n < 0) return errno == EAGAIN || errno == EINTR ? 0 : -1;
+  if (n == 0) return -1;
+  pc->inLen += n;
+
+  start = pc->in;
+  while ((end = (char *)memchr(start, '\n',
+            pc->inLen - (start - pc->in))) != NULL) {
+    *end = 0;
+    if (clientRequest(pc, start)) return -1;
+    start = end + 1;
+  }
+  pc->inLen -= start - pc->in;
+  memmove(pc->in, start, pc->inLen);
+  return pc->inLen == STORE_LINE_MAX ? -1 : 0;
+}
+
+/* Send the values of subscriptions which changed since last sent */
+static void clientScan(struct client_s *pc)
+{
+  int i, changed;
+
+  for (i = 0; i < pc->nSub; i++) {
+    if (pc->out.len - pc->sent >= STORE_BACKLOG) return;
+    epicsMutexMustLock(storeLock);
+    changed = entries[pc->subId[i]].seq != pc->subSeq[i];
+    epicsMutexUnlock(storeLock);
+    if (changed) clientValue(pc, pc->subId[i], "", &pc->subSeq[i]);
+  }
+}
+
+/* Returns -1 to close the connection */
+static int clientWrite(struct client_s *pc)
+{
+  while (pc->sent < pc->out.len) {
+    ssize_t n = write(pc->fd, pc->out.text + pc->sent,
+      pc->out.len - pc->sent);
+
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && errno == EAGAIN) break;
+    if (n <= 0) return -1;
+    pc->sent += n;
+  }
+  if (pc->sent == pc->out.len) {
+    pc->sent = pc->out.len = 0;
+  }
+  else if (pc->sent >= pc->out.len / 2) {
+    pc->out.len -= pc->sent;
+    memmove(pc->out.text, pc->out.text + pc->sent, pc->out.len);
+    pc->sent = 0;
+  }
+  return pc->out.len > STORE_BACKLOG_MAX ? -1 : 0;
+}
+
+static void clientClose(int i)
+{
+  struct client_s *pc = &clients[i];
+
+  if (DEBUG) fprintf(stderr, "store client %d closed\n", pc->fd);
+  close(pc->fd);
+  while (pc->nSub) clientUnsubscribe(pc, 0);
+  free(pc->in);
+  free(pc->out.text);
+  free(pc->subId);
+  free(pc->subSeq);
+  clients[i] = clients[--nClients];
+}
+
+static void clientAccept(void)
+{
+  struct client_s *pc;
+  int fd = accept(listenFd, NULL, NULL);
+
+  if (fd < 0) return;
+  if (nClients == STORE_MAX_CLIENTS) {
+    fprintf(stderr, "Too many store clients, connection refused\n");
+    close(fd);
+    return;
+  }
+  pc = &clients[nClients];
+  memset(pc, 0, sizeof(*pc));
+  pc->in = (char *)malloc(STORE_LINE_MAX);
+  if (!pc->in) {
+    close(fd);
+    return;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  pc->fd = fd;
+  pc->format = SINK_TEXT;
+  nClients++;
+}
+
+static void storeThread(void *arg)
+{
+  struct pollfd fds[STORE_MAX_CLIENTS + 2];
+  char drain[64];
+  int stop = FALSE;
+  int i;
+
+  while (!stop) {
+    fds[0].fd = listenFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakeFd[0];
+    fds[1].events = POLLIN;
+    for (i = 0; i < nClients; i++) {
+      fds[i + 2].fd = clients[i].fd;
+      fds[i + 2].events = POLLIN;
+      if (clients[i].out.len) fds[i + 2].events |= POLLOUT;
+    }
+    if (poll(fds, nClients + 2, STORE_POLL_MS) < 0) {
+      if (errno != EINTR) {
+        perror("store poll");
+        epicsThreadSleep(STORE_POLL_MS / 1000.0);
+      }
+      for (i = 0; i < nClients + 2; i++) fds[i].revents = 0;
+    }
+
+    epicsMutexMustLock(storeLock);
+    stop = storeStop;
+    epicsMutexUnlock(storeLock);
+
+    if (fds[1].revents & POLLIN) {
+      while (read(wakeFd[0], drain, sizeof(drain)) > 0) ;
+      epicsMutexMustLock(storeLock);
+      wakePending = FALSE;
+      epicsMutexUnlock(storeLock);
+    }
+
+    /* from the end, clientClose moves the last client down */
+    for (i = nClients - 1; i >= 0; i--) {
+      if ((fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) &&
+          clientRead(&clients[i]))
+        clientClose(i);
+    }
+    if (fds[0].revents & POLLIN) clientAccept();
+
+    for (i = nClients - 1; i >= 0; i--) {
+      clientScan(&clients[i]);
+      if (clientWrite(&clients[i])) clientClose(i);
+    }
+  }
+
+  while (nClients) clientClose(nClients - 1);
+  epicsEventSignal(storeDone);
+}
+
+#endif /* _WIN32 */
+
+int storeOpen(const char *path)
+{
+#ifdef _WIN32
+  fprintf(stderr, "-serve is not available on this system\n");
+  return -1;
+#else
+  struct sockaddr_un addr;
+  struct stat st;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  /* a socket nobody answers is left over, one that answers is in use */
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "Socket %s is already being served\n", path);
+    close(fd);
+    return -1;
+  }
+  if (fd >= 0) close(fd);
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "%s exists and is not a socket\n", path);
+      return -1;
+    }
+    unlink(path);
+  }
+
+  listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenFd < 0 ||
+      bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listenFd, 16) < 0) {
+    fprintf(stderr, "Unable to serve on %s\n", path);
+    perror("socket");
+    if (listenFd >= 0) close(listenFd);
+    listenFd = -1;
+    return -1;
+  }
+  fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+
+  if (pipe(wakeFd) < 0) {
+    perror("pipe");
+    close(listenFd);
+    listenFd = -1;
+    return -1;
+  }
+  fcntl(wakeFd[0], F_SETFL, fcntl(wakeFd[0], F_GETFL) | O_NONBLOCK);
+  fcntl(wakeFd[1], F_SETFL, fcntl(wakeFd[1], F_GETFL) | O_NONBLOCK);
+#ifdef SIGPIPE
+  signal(SIGPIPE, SIG_IGN);     /* a client going away is not fatal */
+#endif
+
+  storePath = (char *)malloc(strlen(path) + 1);
+  if (storePath) strcpy(storePath, path);
+  storeLock = epicsMutexMustCreate();
+  storeDone = epicsEventMustCreate(epicsEventEmpty);
+  if (!epicsThreadCreate("camonitorStore", epicsThreadPriorityLow,
+        epicsThreadGetStackSize(epicsThreadStackMedium), storeThread, NULL)) {
+    fprintf(stderr, "Unable to start store thread\n");
+    return -1;
+  }
+  fprintf(stderr, "Serving latest values on %s\n", path);
+  return 0;
+#endif
+}
+
+/* After the shards have stopped */
+void storeClose(void)
+{
+#ifndef _WIN32
+  if (listenFd < 0) return;
+  epicsMutexMustLock(storeLock);
+  storeStop = TRUE;
+  epicsMutexUnlock(storeLock);
+  if (write(wakeFd[1], "", 1) < 0) {
+    /* pipe full, the server wakes up anyway */
+  }
+  epicsEventMustWait(storeDone);
+  close(listenFd);
+  listenFd = -1;
+  close(wakeFd[0]);
+  close(wakeFd[1]);
+  if (storePath) unlink(storePath);
+#endif
+}
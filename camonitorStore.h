@@ -0,0 +1,60 @@
+/*************************************************************************\
+* Copyright (c) 2002 The University of Chicago, as Operator of Argonne
+* National Laboratory.
+* Copyright (c) 2002 The Regents of the University of California, as
+* Operator of Los Alamos National Laboratory.
+* This file is distributed subject to a Software License Agreement found
+* in the file LICENSE that is included with this distribution.
+\*************************************************************************/
+
+#ifndef INCcamonitorStoreh
+#define INCcamonitorStoreh
+
+/*
+ * $Id$
+ *
+ * Latest value store used by "camonitor -serve path".  processNewEvent
+ * copies the DBR_TIME_xxx buffer of every update into a table with one
+ * entry per PV; scalars are kept inside the entry itself.  Nothing is
+ * formatted on update.  A background thread answers local clients on the
+ * Unix domain stream socket at path, formatting values only when they
+ * are asked for.
+ *
+ * Requests are lines of words separated by blanks:
+ *
+ *   GET name ...            latest value of each name, in the given order
+ *   SUBSCRIBE name ...      latest value now, then each time it changes
+ *   UNSUBSCRIBE name ...
+ *   FORMAT text|json|binary responses on this connection, default text
+ *
+ * Any other request closes the connection.  A response is one update in
+ * the chosen output format: a camonitor text line, a JSON object
+ * (camonitorJson.c) or a binary record (camonitorSink.h).  A name without
+ * a value gives the name and "no value" in text, an object with
+ * "error":"no value" in JSON, or a binary record with dbrType
+ * STORE_NO_VALUE and count 0.
+ *
+ * The last value is not served once the PV disconnects, or once it is
+ * stopped from stdin.  It is answered the same way, with "disconnected"
+ * and STORE_DISCONNECTED, or "not monitored" and STORE_STOPPED, until the
+ * next update.  Subscribers get that answer when it happens.
+ *
+ * Subscriptions get the latest value, not every update.  A client that
+ * reads slower than a PV changes skips the values it was too slow for.
+ * A client that stops reading altogether is disconnected.
+ */
+
+#include "cadef.h"
+
+#include "camonitor.h"
+
+#define STORE_NO_VALUE      0xffff      /* binary dbrType, no value yet */
+#define STORE_DISCONNECTED  0xfffe      /* binary dbrType, PV disconnected */
+#define STORE_STOPPED       0xfffd      /* binary dbrType, PV stopped */
+
+int  storeOpen(const char *path);
+void storeUpdate(struct monitor_s *pmon, const struct event_handler_args *pargs);
+void storeStale(struct monitor_s *pmon, int why);
+void storeClose(void);
+
+#endif /* INCcamonitorStoreh */